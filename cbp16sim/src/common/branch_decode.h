@@ -0,0 +1,102 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2015 Samsung Austin Semiconductor, LLC.                //
+//            2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    branch_decode.h
+ * \brief   Turns BT9 branch instances into pre-decoded branch records
+ *
+ * This is the OpType classification the CBP2016 drivers perform for every branch
+ * (JD2_2_2016), factored out so that drivers and tools decode a trace the same way.
+ */
+
+#ifndef BRANCH_DECODE_H
+#define BRANCH_DECODE_H
+
+#include "utils.h"
+#include "bt9_reader.h"
+#include "cbp_plugin.h"
+
+/*!
+ * \brief Break a static branch class down into all possible OpTypes
+ * \return OPTYPE_ERROR if the class does not describe a valid branch (e.g. the dummy
+ *         first node of the graph)
+ */
+inline OpType decodeOpType(const bt9::BrClass &br_class) {
+    bool cond = (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL);
+    bool uncond = (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL);
+
+    if (!cond && !uncond) {
+        return OPTYPE_ERROR;
+    }
+
+    if (br_class.type == bt9::BrClass::Type::RET) {
+        return cond ? OPTYPE_RET_COND : OPTYPE_RET_UNCOND;
+    } else if (br_class.directness == bt9::BrClass::Directness::INDIRECT) {
+        if (br_class.type == bt9::BrClass::Type::CALL) {
+            return cond ? OPTYPE_CALL_INDIRECT_COND : OPTYPE_CALL_INDIRECT_UNCOND;
+        } else if (br_class.type == bt9::BrClass::Type::JMP) {
+            return cond ? OPTYPE_JMP_INDIRECT_COND : OPTYPE_JMP_INDIRECT_UNCOND;
+        }
+    } else if (br_class.directness == bt9::BrClass::Directness::DIRECT) {
+        if (br_class.type == bt9::BrClass::Type::CALL) {
+            return cond ? OPTYPE_CALL_DIRECT_COND : OPTYPE_CALL_DIRECT_UNCOND;
+        } else if (br_class.type == bt9::BrClass::Type::JMP) {
+            return cond ? OPTYPE_JMP_DIRECT_COND : OPTYPE_JMP_DIRECT_UNCOND;
+        }
+    }
+
+    return OPTYPE_ERROR;
+}
+
+/// Indicate if the OpType is one of the conditional branch types
+inline bool isConditionalOpType(OpType opType) {
+    return (opType >= OPTYPE_RET_COND) && (opType <= OPTYPE_CALL_INDIRECT_COND);
+}
+
+/*!
+ * \brief Decode a branch instance into a record, without exiting on an undecodable branch
+ * \return 1 for a record, 0 for the dummy (fake) branch at the beginning of the trace, -1
+ *         if the branch does not decode (OPTYPE_ERROR anywhere else): hosts that must
+ *         survive a malformed trace (the Python module) report it themselves
+ */
+inline int tryDecodeBranchRecord(bt9::BT9BranchInstance &br_inst, cbp_branch_record &rec) {
+    const bt9::BT9ReaderNodeRecord *src_node = br_inst.getSrcNode();
+    OpType opType = decodeOpType(src_node->brClass());
+
+    if (opType == OPTYPE_ERROR) {
+        //only fault if it isn't the first node in the graph (fake branch)
+        return src_node->brNodeIndex() ? -1 : 0;
+    }
+
+    rec.PC = src_node->brVirtualAddr();
+    rec.branchTarget = br_inst.getEdge()->brVirtualTarget();
+    rec.opType = opType;
+    rec.conditional = isConditionalOpType(opType);
+    rec.branchTaken = br_inst.getEdge()->isTakenPath();
+    rec.predDir = false;
+    rec.reserved = 0;
+
+    return 1;
+}
+
+/*!
+ * \brief Decode a branch instance into a record
+ * \return false for the dummy (fake) branch at the beginning of the trace, which drivers
+ *         must skip
+ * \note An undecodable branch anywhere else is fatal; this should never happen, if it
+ *       does please email CBP org chair.
+ */
+inline bool decodeBranchRecord(bt9::BT9BranchInstance &br_inst, cbp_branch_record &rec) {
+    int decoded = tryDecodeBranchRecord(br_inst, rec);
+    if (decoded < 0) {
+        fprintf(stderr, "OPTYPE_ERROR\n");
+        printf("OPTYPE_ERROR\n");
+        exit(-1);
+    }
+    return decoded > 0;
+}
+
+// BRANCH_DECODE_H
+#endif
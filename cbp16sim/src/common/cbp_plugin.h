@@ -0,0 +1,110 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    cbp_plugin.h
+ * \brief   Stable C ABI for native predictors loaded at run time (simnlog --plugin)
+ *
+ * A plugin is a shared object that exports a single function, cbp_plugin_get_api(),
+ * returning a pointer to a statically allocated cbp_plugin_api table. Everything the
+ * simulator needs goes through that table, so a plugin can be rebuilt and swapped in
+ * without touching the simulator. Keep this header C-compatible: plugins may be written
+ * in C, C++ or anything else that can produce a C function table.
+ *
+ * Minimal plugin:
+ *
+ *     static const cbp_plugin_api api = {
+ *         CBP_PLUGIN_ABI_VERSION, "my-predictor",
+ *         my_create, my_destroy, my_get_prediction, my_update, my_track_other,
+ *         NULL,   // process_batch is optional
+ *         NULL,   // storage_bits is optional
+ *         NULL    // reset is optional
+ *     };
+ *     CBP_PLUGIN_EXPORT const cbp_plugin_api *cbp_plugin_get_api(void) { return &api; }
+ */
+
+#ifndef CBP_PLUGIN_H
+#define CBP_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Bump whenever cbp_branch_record or cbp_plugin_api change layout
+#define CBP_PLUGIN_ABI_VERSION  2
+
+/// Name of the symbol the loader looks up with dlsym()
+#define CBP_PLUGIN_ENTRY_POINT  "cbp_plugin_get_api"
+
+#if defined(__GNUC__)
+#define CBP_PLUGIN_EXPORT __attribute__((visibility("default")))
+#else
+#define CBP_PLUGIN_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * \brief Pre-decoded branch handed to the batched entry point (24 bytes)
+ *
+ * opType carries the OpType values from utils.h (OPTYPE_RET_UNCOND, ...). The simulator
+ * fills in every field except predDir, which the plugin writes for conditional records.
+ */
+typedef struct cbp_branch_record {
+    uint64_t PC;
+    uint64_t branchTarget;
+    uint32_t opType;
+    uint8_t conditional;
+    uint8_t branchTaken;
+    uint8_t predDir;
+    uint8_t reserved;
+} cbp_branch_record;
+
+/*!
+ * \brief Function table exported by a plugin
+ *
+ * The per-branch entry points mirror the PREDICTOR class used by simnlog. process_batch
+ * must behave exactly like calling them in trace order: for a conditional record,
+ * predDir = get_prediction(PC) followed by update(...); otherwise track_other(...).
+ * Passing many records per call amortizes the indirect call overhead. When it is NULL
+ * the simulator falls back to the per-branch entry points.
+ */
+typedef struct cbp_plugin_api {
+    /// Must be CBP_PLUGIN_ABI_VERSION
+    uint32_t abi_version;
+
+    /// Human-readable predictor name (printed by the simulator)
+    const char *name;
+
+    void *(*create)(void);
+
+    void (*destroy)(void *pred);
+
+    int (*get_prediction)(void *pred, uint64_t PC);
+
+    void (*update)(void *pred, uint64_t PC, uint32_t opType, int resolveDir, int predDir,
+                   uint64_t branchTarget);
+
+    void (*track_other)(void *pred, uint64_t PC, uint32_t opType, int taken, uint64_t branchTarget);
+
+    /// Optional (may be NULL): predict and update n records in order, filling predDir
+    void (*process_batch)(void *pred, cbp_branch_record *recs, size_t n);
+
+    /// Optional (may be NULL): predictor storage budget in bits
+    uint64_t (*storage_bits)(void *pred);
+
+    /// Optional (may be NULL): bring pred back to its state right after create(); without
+    /// it the simulator destroys the predictor and creates a new one
+    void (*reset)(void *pred);
+} cbp_plugin_api;
+
+typedef const cbp_plugin_api *(*cbp_plugin_get_api_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+// CBP_PLUGIN_H
+#endif
@@ -0,0 +1,137 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    cbp_plugin_loader.h
+ * \brief   dlopen()-based loader for predictors implementing the cbp_plugin.h ABI
+ */
+
+#ifndef CBP_PLUGIN_LOADER_H
+#define CBP_PLUGIN_LOADER_H
+
+#include <dlfcn.h>
+#include <string>
+
+#include "utils.h"
+#include "cbp_plugin.h"
+
+/*!
+ * \class CBPPlugin
+ * \brief Owns a loaded plugin and one predictor instance created through it
+ *
+ * The member functions follow the PREDICTOR interface so drivers can use either one.
+ * Loading problems are fatal, like every other setup error in the drivers.
+ */
+class CBPPlugin {
+    public:
+        explicit CBPPlugin(const std::string &path) : path_(path) {
+            handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (handle_ == nullptr) {
+                fprintf(stderr, "Fatal error: cannot load plugin \'%s\': %s\n", path.c_str(), dlerror());
+                exit(-1);
+            }
+
+            // POSIX-sanctioned way of turning a void * into a function pointer
+            cbp_plugin_get_api_fn get_api;
+            *(void **) (&get_api) = dlsym(handle_, CBP_PLUGIN_ENTRY_POINT);
+            if (get_api == nullptr) {
+                fprintf(stderr, "Fatal error: plugin \'%s\' does not export %s\n", path.c_str(),
+                        CBP_PLUGIN_ENTRY_POINT);
+                exit(-1);
+            }
+
+            api_ = get_api();
+            if (api_ == nullptr || api_->abi_version != CBP_PLUGIN_ABI_VERSION) {
+                fprintf(stderr, "Fatal error: plugin \'%s\' was built for ABI version %u (expected %u)\n",
+                        path.c_str(), api_ ? api_->abi_version : 0, CBP_PLUGIN_ABI_VERSION);
+                exit(-1);
+            }
+
+            if (!api_->create || !api_->destroy || !api_->get_prediction || !api_->update || !api_->track_other) {
+                fprintf(stderr, "Fatal error: plugin \'%s\' is missing a required entry point\n", path.c_str());
+                exit(-1);
+            }
+
+            pred_ = api_->create();
+            if (pred_ == nullptr) {
+                fprintf(stderr, "Fatal error: plugin \'%s\' failed to create a predictor\n", path.c_str());
+                exit(-1);
+            }
+        }
+
+        CBPPlugin(const CBPPlugin &) = delete;
+
+        CBPPlugin &operator=(const CBPPlugin &) = delete;
+
+        ~CBPPlugin() {
+            api_->destroy(pred_);
+            dlclose(handle_);
+        }
+
+        /// Start over from a pristine predictor (e.g. before the next trace), in place if the plugin can
+        void reset() {
+            if (api_->reset) {
+                api_->reset(pred_);
+            } else {
+                recreate();
+            }
+        }
+
+        /// Replace the predictor instance with a fresh one
+        void recreate() {
+            api_->destroy(pred_);
+            pred_ = api_->create();
+            if (pred_ == nullptr) {
+                fprintf(stderr, "Fatal error: plugin \'%s\' failed to create a predictor\n", path_.c_str());
+                exit(-1);
+            }
+        }
+
+        const char *name() const { return api_->name ? api_->name : path_.c_str(); }
+
+        /// Indicate if the plugin implements the batched entry point natively
+        bool hasBatch() const { return api_->process_batch != nullptr; }
+
+        /// Storage budget reported by the plugin (0 if it does not report one)
+        UINT64 storageBits() const { return api_->storage_bits ? api_->storage_bits(pred_) : 0; }
+
+        bool GetPrediction(UINT64 PC) {
+            return api_->get_prediction(pred_, PC) != 0;
+        }
+
+        void UpdatePredictor(UINT64 PC, OpType opType, bool resolveDir, bool predDir, UINT64 branchTarget) {
+            api_->update(pred_, PC, opType, resolveDir, predDir, branchTarget);
+        }
+
+        void TrackOtherInst(UINT64 PC, OpType opType, bool taken, UINT64 branchTarget) {
+            api_->track_other(pred_, PC, opType, taken, branchTarget);
+        }
+
+        /// Predict and update a batch of records in trace order, filling predDir
+        void ProcessBatch(cbp_branch_record *recs, size_t n) {
+            if (api_->process_batch) {
+                api_->process_batch(pred_, recs, n);
+                return;
+            }
+
+            for (size_t i = 0; i < n; i++) {
+                cbp_branch_record &rec = recs[i];
+                if (rec.conditional) {
+                    rec.predDir = api_->get_prediction(pred_, rec.PC) != 0;
+                    api_->update(pred_, rec.PC, rec.opType, rec.branchTaken, rec.predDir, rec.branchTarget);
+                } else {
+                    api_->track_other(pred_, rec.PC, rec.opType, rec.branchTaken, rec.branchTarget);
+                }
+            }
+        }
+
+    private:
+        std::string path_;
+        void *handle_ = nullptr;
+        const cbp_plugin_api *api_ = nullptr;
+        void *pred_ = nullptr;
+};
+
+// CBP_PLUGIN_LOADER_H
+#endif
@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    decode_ahead.h
+ * \brief   Decodes a BT9 trace on a producer thread, ahead of the simulation loop
+ *
+ * Gunzipping, BT9 parsing and OpType classification run on their own thread, which fills
+ * a ring of chunks of pre-decoded branch records; the simulation loop only consumes the
+ * chunks in trace order. Nothing on the producer side touches the Python interpreter, so
+ * in simpython the decoding overlaps with the predictor's Python code and is hidden as
+ * long as the predictor is the slower of the two.
+ *
+ * There is exactly one producer and one consumer: a chunk is either being filled or being
+ * consumed, and the mutex is only taken once per chunk to hand it over. On a single CPU
+ * there is nothing to overlap with, so the chunks are decoded on demand by the consumer
+ * (CBP_DECODE_AHEAD=0 or 1 in the environment forces either way).
+ */
+
+#ifndef DECODE_AHEAD_H
+#define DECODE_AHEAD_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bt9_reader.h"
+#include "branch_decode.h"
+
+#define DECODE_AHEAD_CHUNK 1024  // records per hand-over
+#define DECODE_AHEAD_CHUNKS 16   // chunks in the ring
+
+/*!
+ * \class DecodeAhead
+ * \brief Single-producer single-consumer ring of decoded branch record chunks
+ */
+class DecodeAhead {
+    public:
+        /// Start decoding reader (which must outlive this object), on a new thread if useful
+        explicit DecodeAhead(bt9::BT9Reader &reader)
+            : reader_(reader), it_(reader.begin()), threaded_(useThread()),
+              chunks_(threaded_ ? DECODE_AHEAD_CHUNKS : 1) {
+            for (Chunk &chunk : chunks_) {
+                chunk.recs.resize(DECODE_AHEAD_CHUNK);
+            }
+            if (threaded_) {
+                producer_ = std::thread(&DecodeAhead::produce, this);
+            }
+        }
+
+        DecodeAhead(const DecodeAhead &) = delete;
+
+        DecodeAhead &operator=(const DecodeAhead &) = delete;
+
+        ~DecodeAhead() {
+            if (!threaded_) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            not_full_.notify_one();
+            producer_.join();
+        }
+
+        /*!
+         * \brief Wait for the next chunk (release() it when done)
+         * \param skipped the number of trace branches that were not decoded into records
+         *        (the dummy branch at the beginning of the trace), which precede recs
+         * \return false once the whole trace was consumed
+         */
+        bool acquire(const cbp_branch_record *&recs, size_t &size, size_t &skipped) {
+            if (!threaded_) {
+                if (done_) {
+                    return false;
+                }
+                done_ = fill(chunks_[0]);
+            } else {
+                std::unique_lock<std::mutex> lock(mutex_);
+                not_empty_.wait(lock, [this] { return filled_ > 0 || done_; });
+                if (filled_ == 0) {
+                    return false;
+                }
+            }
+            const Chunk &chunk = chunks_[head_];
+            recs = chunk.recs.data();
+            size = chunk.size;
+            skipped = chunk.skipped;
+            return true;
+        }
+
+        /// Give the chunk from the last acquire() back to the producer
+        void release() {
+            if (!threaded_) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                head_ = (head_ + 1) % chunks_.size();
+                filled_--;
+            }
+            not_full_.notify_one();
+        }
+
+    private:
+        struct Chunk {
+            std::vector<cbp_branch_record> recs;
+            size_t size = 0;
+            size_t skipped = 0;
+        };
+
+        static bool useThread() {
+            const char *env = getenv("CBP_DECODE_AHEAD");
+            if (env != NULL && env[0] != '\0') {
+                return atoi(env) != 0;
+            }
+            return std::thread::hardware_concurrency() > 1;
+        }
+
+        /// Decode the next records of the trace into chunk, true at the end of the trace
+        bool fill(Chunk &chunk) {
+            chunk.size = 0;
+            chunk.skipped = 0;
+            try {
+                for (; it_ != reader_.end() && chunk.size < DECODE_AHEAD_CHUNK; ++it_) {
+                    if (decodeBranchRecord(*it_, chunk.recs[chunk.size])) {
+                        chunk.size++;
+                    } else {
+                        chunk.skipped++;
+                    }
+                }
+            }
+            catch (const std::out_of_range &ex) {
+                std::cout << ex.what() << '\n';
+                return true;
+            }
+            return it_ == reader_.end();
+        }
+
+        void produce() {
+            size_t tail = 0;
+            bool end = false;
+            while (!end) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    not_full_.wait(lock, [this] { return filled_ < chunks_.size() || stop_; });
+                    if (stop_) {
+                        return;
+                    }
+                }
+
+                // the chunk at tail is not visible to the consumer until it is published
+                end = fill(chunks_[tail]);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    filled_++;
+                    done_ = end;
+                }
+                not_empty_.notify_one();
+                tail = (tail + 1) % chunks_.size();
+            }
+        }
+
+        bt9::BT9Reader &reader_;
+        bt9::BT9Reader::BranchInstanceIterator it_;
+        bool threaded_;
+        std::vector<Chunk> chunks_;
+        std::mutex mutex_;
+        std::condition_variable not_empty_;
+        std::condition_variable not_full_;
+        size_t head_ = 0;    // next chunk to consume
+        size_t filled_ = 0;  // published chunks not released yet
+        bool done_ = false;  // no chunks after the published ones
+        bool stop_ = false;
+        std::thread producer_;
+};
+
+// DECODE_AHEAD_H
+#endif
@@ -0,0 +1,158 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    npy_writer.h
+ * \brief   Streams rows of a fixed-size record into NumPy .npy files
+ *
+ * The number of rows is not known until the end of a trace, so the header is written with
+ * room for the largest possible shape and rewritten in place when a file is closed. The
+ * header is padded to a multiple of 64 bytes, which keeps the data aligned for
+ * np.load(path, mmap_mode='r'). With shard_rows > 0 the rows are split into files of at
+ * most shard_rows rows each, <prefix>.00000.npy, <prefix>.00001.npy, ...; otherwise they
+ * all go to <prefix>.npy.
+ */
+
+#ifndef NPY_WRITER_H
+#define NPY_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#define NPY_WRITER_BUFFER (1 << 20)  // stdio buffer of each open file
+
+/*!
+ * \class NpyWriter
+ * \brief Writer of one (optionally sharded) one-dimensional .npy array
+ */
+class NpyWriter {
+    public:
+        /*!
+         * \param descr the NumPy dtype of a row as it appears in the header, e.g. "'<u8'" or
+         *        "[('PC', '<u8'), ('taken', 'u1')]"; the fields must be packed (no padding)
+         * \param row_size the size of a row in bytes
+         */
+        NpyWriter(const std::string &prefix, const std::string &descr, size_t row_size, uint64_t shard_rows = 0)
+            : prefix_(prefix), descr_(descr), row_size_(row_size), shard_rows_(shard_rows) {
+            header_size_ = header(UINT64_MAX).size();
+        }
+
+        NpyWriter(const NpyWriter &) = delete;
+
+        NpyWriter &operator=(const NpyWriter &) = delete;
+
+        ~NpyWriter() {
+            close();
+        }
+
+        /// Append n rows (n * row_size bytes), false on an I/O error
+        bool write(const void *rows, size_t n) {
+            const char *data = (const char *) rows;
+            while (ok_ && n > 0) {
+                if (file_ == NULL || (shard_rows_ > 0 && file_rows_ == shard_rows_)) {
+                    if (!open()) {
+                        break;
+                    }
+                }
+                size_t count = n;
+                if (shard_rows_ > 0 && count > shard_rows_ - file_rows_) {
+                    count = (size_t) (shard_rows_ - file_rows_);
+                }
+                ok_ = fwrite(data, row_size_, count, file_) == count;
+                file_rows_ += count;
+                rows_ += count;
+                data += count * row_size_;
+                n -= count;
+            }
+            return ok_;
+        }
+
+        /// Finish the last file (an empty array if nothing was written), false on an I/O error
+        bool close() {
+            if (!closed_ && file_ == NULL) {
+                open();
+            }
+            closed_ = true;
+            finish();
+            return ok_;
+        }
+
+        uint64_t rows() const {
+            return rows_;
+        }
+
+        unsigned files() const {
+            return files_;
+        }
+
+        /// Name of the file holding the rows of shard index (of the only file without shards)
+        std::string path(unsigned index) const {
+            if (shard_rows_ == 0) {
+                return prefix_ + ".npy";
+            }
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), ".%05u.npy", index);
+            return prefix_ + suffix;
+        }
+
+    private:
+        /// The .npy (version 1.0) header of an array of rows rows, header_size_ bytes once known
+        std::string header(uint64_t rows) const {
+            char shape[32];
+            snprintf(shape, sizeof(shape), "(%llu,)", (unsigned long long) rows);
+            std::string dict = "{'descr': " + descr_ + ", 'fortran_order': False, 'shape': " + shape + ", }";
+            size_t size = header_size_ ? header_size_ : (10 + dict.size() + 1 + 63) / 64 * 64;
+            dict.append(size - 10 - dict.size() - 1, ' ');
+            dict += '\n';
+
+            std::string out("\x93NUMPY\x01\x00", 8);
+            out += (char) ((size - 10) & 0xff);
+            out += (char) ((size - 10) >> 8);
+            return out + dict;
+        }
+
+        bool open() {
+            finish();
+            std::string name = path(files_);
+            file_ = fopen(name.c_str(), "wb");
+            if (file_ == NULL) {
+                fprintf(stderr, "Cannot open %s for writing\n", name.c_str());
+                ok_ = false;
+                return false;
+            }
+            setvbuf(file_, NULL, _IOFBF, NPY_WRITER_BUFFER);
+            files_++;
+            file_rows_ = 0;
+            std::string head = header(0);
+            ok_ = fwrite(head.data(), 1, head.size(), file_) == head.size();
+            return ok_;
+        }
+
+        /// Rewrite the header of the open file with its final shape and close it
+        void finish() {
+            if (file_ == NULL) {
+                return;
+            }
+            std::string head = header(file_rows_);
+            ok_ = ok_ && fseek(file_, 0, SEEK_SET) == 0 && fwrite(head.data(), 1, head.size(), file_) == head.size();
+            ok_ = fclose(file_) == 0 && ok_;
+            file_ = NULL;
+        }
+
+        std::string prefix_;
+        std::string descr_;
+        size_t row_size_;
+        uint64_t shard_rows_;
+        size_t header_size_ = 0;
+        FILE *file_ = NULL;
+        uint64_t file_rows_ = 0;  // rows in the open file
+        uint64_t rows_ = 0;       // rows in all files
+        unsigned files_ = 0;
+        bool ok_ = true;
+        bool closed_ = false;
+};
+
+// NPY_WRITER_H
+#endif
@@ -0,0 +1,103 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    perf_counters.h
+ * \brief   Minimal perf_event_open() wrapper for reading hardware events of this process
+ *
+ * Used to report things like data TLB misses alongside the simulation statistics. Opening
+ * a counter can fail (non-Linux, containers, kernel.perf_event_paranoid too strict,
+ * unsupported event): the counter then simply reports that it is unavailable.
+ */
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/*!
+ * \class PerfCounter
+ * \brief One user-space-only hardware event counter for the calling thread
+ */
+class PerfCounter {
+    public:
+        PerfCounter(uint32_t type, uint64_t config) {
+#ifdef __linux__
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_ = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+            (void) type;
+            (void) config;
+#endif
+        }
+
+        PerfCounter(const PerfCounter &) = delete;
+
+        PerfCounter &operator=(const PerfCounter &) = delete;
+
+        ~PerfCounter() {
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+        }
+
+        /// Data TLB load misses (the event the predictor table arena targets)
+        static PerfCounter *dtlbLoadMisses() {
+#ifdef __linux__
+            return new PerfCounter(PERF_TYPE_HW_CACHE,
+                                   PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+            return new PerfCounter(0, 0);
+#endif
+        }
+
+        bool available() const { return fd_ >= 0; }
+
+        void start() {
+#ifdef __linux__
+            if (fd_ >= 0) {
+                ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        void stop() {
+#ifdef __linux__
+            if (fd_ >= 0) {
+                ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            }
+#endif
+        }
+
+        uint64_t value() const {
+            uint64_t count = 0;
+            if (fd_ < 0 || read(fd_, &count, sizeof(count)) != sizeof(count)) {
+                return 0;
+            }
+            return count;
+        }
+
+    private:
+        int fd_ = -1;
+};
+
+// PERF_COUNTERS_H
+#endif
@@ -0,0 +1,76 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    sim_regions.h
+ * \brief   Representative regions of traces, as written by bt9simpoint and read by simnlog
+ *
+ * A regions file has one region per line, "<trace> <start> <branches> <weight>": the file
+ * name of the trace (without its directory), the index of the first branch of the region
+ * (counting from 0, without the dummy branch at the beginning of the trace), its number of
+ * branches and the share of the trace it stands for. The weights of the regions of a
+ * trace add up to 1. Everything after a '#' is a comment.
+ */
+
+#ifndef SIM_REGIONS_H
+#define SIM_REGIONS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct SimRegion {
+    uint64_t start;
+    uint64_t branches;
+    double weight;
+};
+
+/// The name regions files know a trace by: its file name without the directory
+inline std::string RegionTraceName(const std::string &trace_path) {
+    size_t slash = trace_path.rfind('/');
+    return trace_path.substr(slash == std::string::npos ? 0 : slash + 1);
+}
+
+/*!
+ * \brief Read a regions file into the regions of each trace, sorted by start
+ * \return false if the file cannot be read or a line is malformed (reported on stderr)
+ */
+inline bool ReadRegions(const std::string &path, std::map<std::string, std::vector<SimRegion> > &regions) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "Cannot open regions file %s\n", path.c_str());
+        return false;
+    }
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); line_number++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string trace;
+        SimRegion region;
+        if (!(fields >> trace)) {
+            continue;
+        }
+        std::string rest;
+        if (!(fields >> region.start >> region.branches >> region.weight) || (fields >> rest) ||
+            region.branches == 0 || region.weight < 0.0) {
+            fprintf(stderr, "%s:%d: expected <trace> <start> <branches> <weight>\n", path.c_str(), line_number);
+            return false;
+        }
+        regions[trace].push_back(region);
+    }
+    for (auto &trace : regions) {
+        std::sort(trace.second.begin(), trace.second.end(), [](const SimRegion &a, const SimRegion &b) {
+            return a.start < b.start;
+        });
+    }
+    return true;
+}
+
+// SIM_REGIONS_H
+#endif
@@ -0,0 +1,85 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    simd_dispatch.h
+ * \brief   Run-time selection of the vector code paths used by the predictors
+ *
+ * The binaries are built for the baseline x86-64 ISA; kernels that benefit from wider
+ * vectors are compiled per function with __attribute__((target(...))) and picked at run
+ * time from what the CPU reports. Every vector path has a scalar twin producing identical
+ * results. Setting CBP_SIMD=scalar|avx2|avx512 in the environment caps the level, which
+ * is handy for checking that the paths agree.
+ */
+
+#ifndef SIMD_DISPATCH_H
+#define SIMD_DISPATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CBP_X86_SIMD
+#include <immintrin.h>
+#define CBP_TARGET_AVX2    __attribute__((target("avx2,bmi,lzcnt")))
+#define CBP_TARGET_AVX512  __attribute__((target("avx512f,avx512bw,avx2,bmi,lzcnt")))
+#endif
+
+enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+inline const char *simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SIMD_AVX512:
+            return "avx512";
+        case SIMD_AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+/// Best vector level supported by the CPU, capped by CBP_SIMD (evaluated once)
+inline SimdLevel simdLevel() {
+    static int level = -1;
+
+    if (level < 0) {
+        SimdLevel best = SIMD_SCALAR;
+#ifdef CBP_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("lzcnt")) {
+            best = SIMD_AVX2;
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+                best = SIMD_AVX512;
+        }
+#endif
+        level = best;
+
+        const char *env = getenv("CBP_SIMD");
+        if (env != nullptr) {
+            SimdLevel cap;
+            if (strcmp(env, "scalar") == 0) {
+                cap = SIMD_SCALAR;
+            } else if (strcmp(env, "avx2") == 0) {
+                cap = SIMD_AVX2;
+            } else if (strcmp(env, "avx512") == 0) {
+                cap = SIMD_AVX512;
+            } else {
+                fprintf(stderr, "Fatal error: unknown CBP_SIMD value \'%s\' (scalar, avx2 or avx512)\n", env);
+                exit(-1);
+            }
+            if (cap < best)
+                level = cap;
+        }
+    }
+
+    return (SimdLevel) level;
+}
+
+// SIMD_DISPATCH_H
+#endif
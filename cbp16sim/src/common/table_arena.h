@@ -0,0 +1,152 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    table_arena.h
+ * \brief   Huge-page backed bump allocator for predictor tables
+ *
+ * Predictor tables are accessed at random, so with multi-megabyte budgets nearly every
+ * lookup also misses in the data TLB. Carving all of them out of one region backed by 2MB
+ * pages cuts the number of pages (and TLB entries) needed by a factor of 512.
+ *
+ * The region is mapped once and kept for the lifetime of the process: rewind() hands the
+ * same memory out again, so a predictor rebuilt for the next trace reuses the pages that
+ * are already faulted in. By default transparent huge pages are requested with
+ * madvise(MADV_HUGEPAGE); with CBP_HUGETLB=1 in the environment explicit huge pages
+ * (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages) are tried first.
+ */
+
+#ifndef TABLE_ARENA_H
+#define TABLE_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE_SIZE (2UL << 20)
+
+/*!
+ * \class TableArena
+ * \brief One mapping that all the tables of a predictor are allocated from
+ */
+class TableArena {
+    public:
+        TableArena() = default;
+
+        TableArena(const TableArena &) = delete;
+
+        TableArena &operator=(const TableArena &) = delete;
+
+        ~TableArena() {
+            if (base_ != nullptr) {
+                munmap(base_, capacity_);
+            }
+        }
+
+        /// Make sure at least size bytes are available (maps or grows the region)
+        void reserve(size_t size) {
+            size = roundUp(size, ARENA_HUGE_PAGE_SIZE);
+            if (size <= capacity_) {
+                return;
+            }
+            if (base_ != nullptr) {
+                if (used_ != 0) {
+                    fprintf(stderr, "Fatal error: cannot grow a table arena that is in use\n");
+                    exit(-1);
+                }
+                munmap(base_, capacity_);
+                base_ = nullptr;
+                capacity_ = 0;
+            }
+
+            const char *hugetlb = getenv("CBP_HUGETLB");
+            void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            if (hugetlb != nullptr && strcmp(hugetlb, "0") != 0) {
+                mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (mem != MAP_FAILED) {
+                    mode_ = "hugetlb";
+                }
+            }
+#endif
+            if (mem == MAP_FAILED) {
+                // over-allocate so that the region can start on a huge page boundary
+                size_t len = size + ARENA_HUGE_PAGE_SIZE;
+                void *raw = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (raw == MAP_FAILED) {
+                    fprintf(stderr, "Fatal error: cannot map %zu bytes for the predictor tables\n", len);
+                    exit(-1);
+                }
+                uintptr_t start = roundUp((uintptr_t) raw, ARENA_HUGE_PAGE_SIZE);
+                size_t head = start - (uintptr_t) raw;
+                if (head) {
+                    munmap(raw, head);
+                }
+                if (len - head > size) {
+                    munmap((char *) start + size, len - head - size);
+                }
+                mem = (void *) start;
+                mode_ = "4k";
+#ifdef MADV_HUGEPAGE
+                if (madvise(mem, size, MADV_HUGEPAGE) == 0) {
+                    mode_ = "thp";
+                }
+#endif
+            }
+
+            base_ = (char *) mem;
+            capacity_ = size;
+            used_ = 0;
+        }
+
+        /// Hand the whole region out again (the previous allocations must no longer be used)
+        void rewind() { used_ = 0; }
+
+        /// Raw, suitably aligned storage; fresh mappings are zeroed, rewound ones are not
+        void *allocate(size_t size, size_t align = 64) {
+            size_t offset = roundUp(used_, align);
+            if (base_ == nullptr || offset + size > capacity_) {
+                fprintf(stderr, "Fatal error: table arena exhausted (%zu of %zu bytes used, %zu requested)\n",
+                        used_, capacity_, size);
+                exit(-1);
+            }
+            used_ = offset + size;
+            return base_ + offset;
+        }
+
+        /// n default-constructed T, like new T[n] (never freed individually)
+        template<class T>
+        T *create(size_t n) {
+            T *p = (T *) allocate(n * sizeof(T), alignof(T) > 64 ? alignof(T) : 64);
+            for (size_t i = 0; i < n; i++) {
+                new(p + i) T();
+            }
+            return p;
+        }
+
+        /// Bytes needed by create<T>(n) (for reserve())
+        template<class T>
+        static size_t footprint(size_t n) { return roundUp(n * sizeof(T), 64); }
+
+        /// How the region is backed: "hugetlb", "thp" (advised) or "4k"
+        const char *mode() const { return mode_; }
+
+        size_t capacity() const { return capacity_; }
+
+    private:
+        static size_t roundUp(size_t x, size_t align) { return (x + align - 1) / align * align; }
+
+        char *base_ = nullptr;
+        size_t capacity_ = 0;
+        size_t used_ = 0;
+        const char *mode_ = "none";
+};
+
+// TABLE_ARENA_H
+#endif
@@ -0,0 +1,75 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+//Description : The built-in TAGE-SC-L predictor packaged as a simnlog plugin
+//
+// Doubles as a template for new plugins: copy this file next to it, swap the predictor
+// header, and `make plugins` builds lib<name>.so from it.
+//   ./simnlog --plugin ./libtagescl.so <trace>
+//
+// NOTE: predictor.h keeps all of its state in globals, so there can only be one live
+// predictor per process (which is all simnlog ever creates).
+
+#include "utils.h"
+#include "cbp_plugin.h"
+#include "predictor.h"
+
+
+static void *tagescl_create(void) {
+    return new PREDICTOR();
+}
+
+static void tagescl_destroy(void *pred) {
+    delete (PREDICTOR *) pred;
+}
+
+static int tagescl_get_prediction(void *pred, uint64_t PC) {
+    return ((PREDICTOR *) pred)->GetPrediction(PC);
+}
+
+static void tagescl_update(void *pred, uint64_t PC, uint32_t opType, int resolveDir, int predDir,
+                           uint64_t branchTarget) {
+    ((PREDICTOR *) pred)->UpdatePredictor(PC, (OpType) opType, resolveDir, predDir, branchTarget);
+}
+
+static void tagescl_track_other(void *pred, uint64_t PC, uint32_t opType, int taken, uint64_t branchTarget) {
+    ((PREDICTOR *) pred)->TrackOtherInst(PC, (OpType) opType, taken, branchTarget);
+}
+
+static void tagescl_process_batch(void *pred, cbp_branch_record *recs, size_t n) {
+    PREDICTOR *brpred = (PREDICTOR *) pred;
+    for (size_t i = 0; i < n; i++) {
+        brpred->PredictAndUpdate(recs[i]);
+        // the history is final: start fetching the tables for the next branch
+        if (i + 1 < n && recs[i + 1].conditional) {
+            brpred->Prefetch(recs[i + 1].PC);
+        }
+    }
+}
+
+static uint64_t tagescl_storage_bits(void *pred) {
+    (void) pred;
+    return predictorsize(false);  // simnlog prints the banner
+}
+
+static void tagescl_reset(void *pred) {
+    ((PREDICTOR *) pred)->reset();
+}
+
+static const cbp_plugin_api tagescl_api = {
+        CBP_PLUGIN_ABI_VERSION,
+        "TAGE-SC-L",
+        tagescl_create,
+        tagescl_destroy,
+        tagescl_get_prediction,
+        tagescl_update,
+        tagescl_track_other,
+        tagescl_process_batch,
+        tagescl_storage_bits,
+        tagescl_reset
+};
+
+extern "C" CBP_PLUGIN_EXPORT const cbp_plugin_api *cbp_plugin_get_api(void) {
+    return &tagescl_api;
+}
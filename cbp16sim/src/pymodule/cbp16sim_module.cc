@@ -0,0 +1,394 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    cbp16sim_module.cc
+ * \brief   The cbp16sim extension module: simulate BT9 traces from a Python process
+ *
+ *     import cbp16sim
+ *     stats = cbp16sim.simulate(trace, predictor=None, batch=None)
+ *
+ * Without a predictor (or with "tage-sc-l") the trace runs through the native TAGE-SC-L
+ * with the GIL released, so several Python threads can simulate traces at the same time.
+ * The native predictor keeps its state in globals: each simulation decodes its trace on
+ * its own, chunk by chunk, and only takes the predictor for the predictions of a chunk,
+ * swapping its predictor state in (and the previous one out) when another simulation
+ * used the predictor in between. Any other predictor is a Python BASEPREDICTOR, driven
+ * per branch or through its batch protocol (batch=N overrides its BATCH_SIZE; the
+ * decoding of each batch also runs without the GIL), or through its __cbp_native__
+ * callbacks without the GIL. The result is a dict with the statistics simnlog prints. A
+ * malformed trace (not BT9, undecodable branches, or fewer or more branches than its header
+ * counts) raises ValueError instead of exiting the process or returning partial statistics;
+ * only errors in the node and edge tables are still fatal inside BT9Reader.
+ */
+
+#define PY_SSIZE_T_CLEAN
+
+#include <Python.h>
+
+#include <unistd.h>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#define NO_PRINTSIZE
+#include "utils.h"
+#include "bt9_reader.h"
+#include "branch_decode.h"
+#include "predictor.h"
+#include "python_predictor.h"
+
+// Counts of one simulation run
+struct TraceStats {
+    UINT64 instructions = 0;
+    UINT64 branches = 0;
+    UINT64 conditional = 0;
+    UINT64 unconditional = 0;
+    UINT64 mispredictions = 0;
+
+    /// false if the instruction or branch count is missing or not a number
+    bool readHeader(bt9::BT9Reader &reader) {
+        std::string instruction_count, branch_count;
+        if (!reader.header.getFieldValueStr("total_instruction_count:", instruction_count) ||
+            !reader.header.getFieldValueStr("branch_instruction_count:", branch_count)) {
+            return false;
+        }
+        try {
+            instructions = std::stoull(instruction_count, nullptr, 0);
+            branches = std::stoull(branch_count, nullptr, 0) - 1; // there is a dummy branch at the beginning of the trace
+        }
+        catch (const std::exception &ex) {
+            return false;
+        }
+        return branches != (UINT64) -1;
+    }
+
+    void record(const cbp_branch_record &rec) {
+        if (rec.conditional) {
+            conditional++;
+            if (rec.predDir != rec.branchTaken) {
+                mispredictions++;
+            }
+        } else {
+            unconditional++;
+        }
+    }
+};
+
+/*!
+ * \brief Check that a file starts like a BT9 trace before BT9Reader, which exits the
+ *        process on a bad header, gets to read it
+ * \return false (with error set) if it is not a BT9 trace or cannot be read; the node and
+ *         edge tables after the header are left to BT9Reader
+ */
+static bool CheckTraceHeader(const std::string &trace_path, std::string &error) {
+    try {
+        // decompressed the same way as BT9Reader does: anything with .gz in its name
+        std::ifstream file(trace_path, std::ios::binary);
+        boost::iostreams::filtering_istream in;
+        if (trace_path.find(".gz") != std::string::npos) {
+            in.push(boost::iostreams::gzip_decompressor());
+        }
+        in.push(file);
+        std::string line, token;
+        if (!std::getline(in, line) || !(std::istringstream(line) >> token) || token != "BT9_SPA_TRACE_FORMAT") {
+            error = "not a BT9 trace";
+            return false;
+        }
+    }
+    catch (const std::exception &ex) {
+        error = std::string("not a BT9 trace (") + ex.what() + ")";
+        return false;
+    }
+    return true;
+}
+
+#define DECODE_CHUNK 1024    // records decoded at a time
+#define NATIVE_CHUNK 16384   // records per turn on the native predictor: amortizes the state swaps
+
+/*!
+ * \class TraceDecoder
+ * \brief Decodes a trace chunk by chunk, and keeps what is wrong with a malformed one
+ *        rather than exiting the host process
+ */
+class TraceDecoder {
+    public:
+        explicit TraceDecoder(bt9::BT9Reader &reader) : reader_(reader), it_(reader.begin()) {}
+
+        /// Decode up to capacity records into recs; false at the end of the trace or on an error
+        bool next(cbp_branch_record *recs, size_t capacity, size_t &size) {
+            size = 0;
+            try {
+                for (; it_ != reader_.end() && size < capacity; ++it_) {
+                    int decoded = tryDecodeBranchRecord(*it_, recs[size]);
+                    if (decoded < 0) {
+                        error_ = "OPTYPE_ERROR at branch node " + std::to_string(it_->getSrcNode()->brNodeIndex());
+                        size = 0;
+                        return false;
+                    }
+                    size += decoded;
+                }
+            }
+            catch (const std::out_of_range &ex) {
+                error_ = ex.what();
+                error_.erase(error_.find_last_not_of('\n') + 1);
+                size = 0;
+                return false;
+            }
+            return size > 0;
+        }
+
+        /// Empty unless the trace turned out to be malformed
+        const std::string &error() const {
+            return error_;
+        }
+
+    private:
+        bt9::BT9Reader &reader_;
+        bt9::BT9Reader::BranchInstanceIterator it_;
+        std::string error_;
+};
+
+// the built-in predictor lives in globals: simulations take turns on it, one chunk at a time
+static std::mutex NativeMutex;
+static PREDICTOR *Native = NULL;
+static std::vector<char> *NativeOwner = NULL;  // the simulation whose state is in the predictor
+
+// Predict and update recs on behalf of the simulation whose saved predictor state is state
+static void PredictNative(std::vector<char> &state, cbp_branch_record *recs, size_t size) {
+    std::lock_guard<std::mutex> lock(NativeMutex);
+    if (Native == NULL) {
+        Native = new PREDICTOR();
+    }
+    if (NativeOwner != &state) {
+        if (NativeOwner != NULL) {
+            Native->save(*NativeOwner);
+        }
+        if (state.empty()) {
+            Native->reset();  // first chunk of the trace
+        } else {
+            Native->load(state);
+        }
+        NativeOwner = &state;
+    }
+    for (size_t i = 0; i < size; i++) {
+        Native->PredictAndUpdate(recs[i]);
+    }
+}
+
+static void SimulateNative(TraceDecoder &decoder, TraceStats &stats) {
+    std::vector<cbp_branch_record> recs(NATIVE_CHUNK);
+    std::vector<char> state;  // the predictor state of this simulation while others run
+    size_t size;
+    while (decoder.next(recs.data(), recs.size(), size)) {
+        PredictNative(state, recs.data(), size);
+        for (size_t i = 0; i < size; i++) {
+            stats.record(recs[i]);
+        }
+    }
+    std::lock_guard<std::mutex> lock(NativeMutex);
+    if (NativeOwner == &state) {
+        NativeOwner = NULL;
+    }
+}
+
+// __cbp_native__ callbacks: the whole trace runs without the GIL
+static void SimulatePythonNative(TraceDecoder &decoder, const PythonNative &native, TraceStats &stats) {
+    std::vector<cbp_branch_record> recs(DECODE_CHUNK);
+    size_t size;
+    while (decoder.next(recs.data(), recs.size(), size)) {
+        RunPythonNative(native, recs.data(), size);
+        for (size_t i = 0; i < size; i++) {
+            stats.record(recs[i]);
+        }
+    }
+}
+
+// one call per branch, as simpython does
+static bool SimulatePythonPerBranch(TraceDecoder &decoder, PyObject *brpred, TraceStats &stats) {
+    PythonCalls *calls = new PythonCalls();
+    const char *failed = NULL;
+    bool ok = InitPythonCalls(*calls, brpred, &failed);
+
+    std::vector<cbp_branch_record> recs(DECODE_CHUNK);
+    size_t size;
+    while (ok && decoder.next(recs.data(), recs.size(), size)) {
+        for (size_t i = 0; ok && i < size; i++) {
+            cbp_branch_record &rec = recs[i];
+            if (rec.conditional) {
+                int predicted = PythonGetPrediction(*calls, rec.PC);
+                ok = predicted >= 0;
+                rec.predDir = predicted > 0;
+                ok = ok && PythonUpdatePredictor(*calls, rec);
+            } else {
+                ok = PythonTrackOtherInst(*calls, rec);
+            }
+            stats.record(rec);
+        }
+    }
+
+    FreePythonCalls(*calls);
+    delete calls;
+    return ok;
+}
+
+// batch protocol: the next batch is decoded without holding the GIL
+static bool SimulatePythonBatched(TraceDecoder &decoder, PyObject *brpred, size_t batch_size, TraceStats &stats) {
+    PythonBatch batch;
+    bool ok = InitPythonBatch(batch, brpred, batch_size);
+
+    bool more = true;
+    while (ok && more) {
+        Py_BEGIN_ALLOW_THREADS
+            more = decoder.next(batch.records->recs, batch.capacity, batch.size);
+        Py_END_ALLOW_THREADS
+
+        if (more) {
+            const char *failed = NULL;
+            ok = RunPythonBatch(batch, &failed);
+            for (size_t i = 0; ok && i < batch.size; i++) {
+                stats.record(batch.records->recs[i]);
+            }
+            ok = ok && RecyclePythonBatch(batch);
+        }
+    }
+
+    FreePythonBatch(batch);
+    return ok;
+}
+
+static PyObject *cbp16sim_simulate(PyObject *self, PyObject *args, PyObject *kwargs) {
+    (void) self;
+    static const char *kwlist[] = {"trace", "predictor", "batch", NULL};
+    const char *trace = NULL;
+    PyObject *predictor = Py_None;
+    PyObject *batch = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO:simulate", const_cast<char **>(kwlist), &trace,
+                                     &predictor, &batch)) {
+        return NULL;
+    }
+    std::string trace_path = trace;
+    if (access(trace, R_OK) != 0) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, trace);
+    }
+
+    bool native = predictor == Py_None;
+    if (PyUnicode_Check(predictor)) {
+        if (PyUnicode_CompareWithASCIIString(predictor, "tage-sc-l") != 0) {
+            PyErr_Format(PyExc_ValueError, "unknown native predictor '%U' (only 'tage-sc-l' is built in)",
+                         predictor);
+            return NULL;
+        }
+        native = true;
+    }
+
+    long batch_size = 0;
+    if (!native) {
+        batch_size = batch == Py_None ? PythonBatchSize(predictor) : PyLong_AsLong(batch);
+        if (batch_size < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "batch must be a non-negative integer");
+            return NULL;
+        }
+    }
+
+    std::string error;
+    bt9::BT9Reader *reader = NULL;
+    Py_BEGIN_ALLOW_THREADS
+        if (CheckTraceHeader(trace_path, error)) {
+            reader = new bt9::BT9Reader(trace_path);
+        }
+    Py_END_ALLOW_THREADS
+    TraceStats stats;
+    if (reader != NULL && !stats.readHeader(*reader)) {
+        error = "no valid total_instruction_count or branch_instruction_count in the header";
+    }
+    if (!error.empty()) {
+        delete reader;
+        PyErr_Format(PyExc_ValueError, "malformed trace %s: %s", trace, error.c_str());
+        return NULL;
+    }
+    TraceDecoder decoder(*reader);
+    bool ok = true;
+    if (native) {
+        Py_BEGIN_ALLOW_THREADS
+            SimulateNative(decoder, stats);
+        Py_END_ALLOW_THREADS
+    } else {
+        PythonNative native;
+        int has_native = InitPythonNative(native, predictor);
+        ok = has_native >= 0;
+        if (has_native > 0) {
+            Py_BEGIN_ALLOW_THREADS
+                SimulatePythonNative(decoder, native, stats);
+            Py_END_ALLOW_THREADS
+        } else if (ok) {
+            ok = batch_size > 0 ? SimulatePythonBatched(decoder, predictor, (size_t) batch_size, stats)
+                                : SimulatePythonPerBranch(decoder, predictor, stats);
+        }
+        FreePythonNative(native);
+    }
+    error = decoder.error();
+    delete reader;
+    if (!ok) {
+        return NULL;
+    }
+    UINT64 simulated = stats.conditional + stats.unconditional;
+    if (error.empty() && simulated != stats.branches) {
+        error = "its header counts " + std::to_string(stats.branches) + " branches, but it has " +
+                std::to_string(simulated);
+    }
+    if (!error.empty()) {
+        // the statistics of the branches before it would pass for those of the whole trace
+        PyErr_Format(PyExc_ValueError, "malformed trace %s: %s", trace, error.c_str());
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:s,s:K,s:K,s:K,s:K,s:K,s:d}",
+                         "TRACE", trace,
+                         "NUM_INSTRUCTIONS", stats.instructions,
+                         "NUM_BR", stats.branches,
+                         "NUM_UNCOND_BR", stats.unconditional,
+                         "NUM_CONDITIONAL_BR", stats.conditional,
+                         "NUM_MISPREDICTIONS", stats.mispredictions,
+                         "MISPRED_PER_1K_INST",
+                         1000.0 * (double) stats.mispredictions / (double) stats.instructions);
+}
+
+static PyMethodDef Cbp16simMethods[] = {
+        {"simulate", (PyCFunction) (void (*)(void)) cbp16sim_simulate, METH_VARARGS | METH_KEYWORDS,
+                "simulate(trace, predictor=None, batch=None) -> dict\n\n"
+                "Simulate a BT9 trace with the native TAGE-SC-L (predictor None or 'tage-sc-l') or a\n"
+                "Python BASEPREDICTOR, and return the statistics simnlog prints."},
+        {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef Cbp16simModule = {
+        PyModuleDef_HEAD_INIT, "cbp16sim", "CBP-16 trace simulation (BT9 reader, TAGE-SC-L, simulation loop)", -1,
+        Cbp16simMethods, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_cbp16sim(void) {
+    PyObject *module = PyModule_Create(&Cbp16simModule);
+    if (module == NULL) {
+        return NULL;
+    }
+    PyTypeObject *type = BranchBatchType();
+    if (type == NULL) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(type);
+    if (PyModule_AddObject(module, "BranchBatch", (PyObject *) type) < 0) {
+        Py_DECREF(type);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,133 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    feature_export.h
+ * \brief   History features of conditional branches for training learned predictors
+ *
+ * simnlog --export-features streams a trace through HistoryFeatures, which keeps the
+ * histories a predictor would see and writes one row per conditional branch: its PC, the
+ * histories right before it and its outcome. The row is a packed NumPy structured dtype
+ * (see descr()); fields with a length of 0 are left out:
+ *
+ *     PC     '<u8'             branch address
+ *     ghist  'u1', (G / 8,)    global history of the last G branches (all of them, taken
+ *                              or not), bit-packed: bit k of byte j is the direction of
+ *                              the (8j + k + 1)-th most recent branch, i.e.
+ *                              np.unpackbits(ghist, axis=-1, bitorder='little')
+ *     path   '<u2', (P,)       low 16 bits of the addresses of the last P branches, most
+ *                              recent first
+ *     lhist  '<u8'             the last L directions of this PC (bit 0 most recent)
+ *     taken  'u1'              outcome, the label
+ */
+
+#ifndef FEATURE_EXPORT_H
+#define FEATURE_EXPORT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cbp_plugin.h"
+
+#define FEATURE_MAX_GHIST_BITS 4096
+#define FEATURE_MAX_PATH_LENGTH 256
+#define FEATURE_MAX_LHIST_BITS 64
+
+/*!
+ * \class HistoryFeatures
+ * \brief Global, path and per-PC local histories of a branch stream, and their rows
+ */
+class HistoryFeatures {
+    public:
+        /// ghist_bits must be a multiple of 8, all lengths within the FEATURE_MAX_* limits
+        HistoryFeatures(unsigned ghist_bits, unsigned path_length, unsigned lhist_bits)
+            : ghist_bits_(ghist_bits), path_length_(path_length), lhist_bits_(lhist_bits),
+              ghist_((ghist_bits + 63) / 64), path_(2 * path_length) {}
+
+        /// The NumPy dtype of a row, for the .npy header
+        std::string descr() const {
+            std::string descr = "[('PC', '<u8'), ";
+            if (ghist_bits_ > 0) {
+                descr += "('ghist', 'u1', (" + std::to_string(ghist_bits_ / 8) + ",)), ";
+            }
+            if (path_length_ > 0) {
+                descr += "('path', '<u2', (" + std::to_string(path_length_) + ",)), ";
+            }
+            if (lhist_bits_ > 0) {
+                descr += "('lhist', '<u8'), ";
+            }
+            return descr + "('taken', 'u1')]";
+        }
+
+        size_t rowSize() const {
+            return 8 + ghist_bits_ / 8 + 2 * path_length_ + (lhist_bits_ > 0 ? 8 : 0) + 1;
+        }
+
+        /// Start over with empty histories (next trace)
+        void reset() {
+            std::fill(ghist_.begin(), ghist_.end(), 0);
+            std::fill(path_.begin(), path_.end(), 0);
+            path_head_ = 0;
+            local_.clear();
+        }
+
+        /*!
+         * \brief Add a branch to the histories
+         * \param row if not NULL, receives the row of the (conditional) branch, with the
+         *        histories as they were before it
+         */
+        void advance(const cbp_branch_record &rec, uint8_t *row) {
+            uint64_t *local = NULL;
+            if (rec.conditional && lhist_bits_ > 0) {
+                local = &local_[rec.PC];
+            }
+
+            if (row != NULL) {
+                memcpy(row, &rec.PC, 8);
+                row += 8;
+                // the host is little-endian, like the dtype
+                memcpy(row, ghist_.data(), ghist_bits_ / 8);
+                row += ghist_bits_ / 8;
+                memcpy(row, path_.data() + path_head_, 2 * path_length_);
+                row += 2 * path_length_;
+                if (lhist_bits_ > 0) {
+                    memcpy(row, local, 8);
+                    row += 8;
+                }
+                *row = rec.branchTaken;
+            }
+
+            if (local != NULL) {
+                *local = (*local << 1 | rec.branchTaken) &
+                         (lhist_bits_ == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << lhist_bits_) - 1);
+            }
+            for (size_t i = ghist_.size(); i-- > 1;) {
+                ghist_[i] = ghist_[i] << 1 | ghist_[i - 1] >> 63;
+            }
+            if (!ghist_.empty()) {
+                ghist_[0] = ghist_[0] << 1 | rec.branchTaken;
+            }
+            if (path_length_ > 0) {
+                // mirrored halves: path_[path_head_ .. path_head_ + P) is the history, newest first
+                path_head_ = (path_head_ + path_length_ - 1) % path_length_;
+                path_[path_head_] = path_[path_head_ + path_length_] = (uint16_t) rec.PC;
+            }
+        }
+
+    private:
+        unsigned ghist_bits_;
+        unsigned path_length_;
+        unsigned lhist_bits_;
+        std::vector<uint64_t> ghist_;  // bit 0 of word 0 is the most recent direction
+        std::vector<uint16_t> path_;
+        size_t path_head_ = 0;
+        std::unordered_map<uint64_t, uint64_t> local_;
+};
+
+// FEATURE_EXPORT_H
+#endif
@@ -9,13 +9,19 @@
 #include "utils.h"
 #include "bt9.h"
 #include "bt9_reader.h"
+#include "cbp_plugin.h"
+#include "simd_dispatch.h"
+#include "table_arena.h"
 
 
 
 #define BORNTICK  1024
 //To get the predictor storage budget on stderr  uncomment the next line
+#ifndef NO_PRINTSIZE
 #define PRINTSIZE
+#endif
 #include <vector>
+#include <utility>
 long long IMLIcount;		// use to monitor the iteration number
 
 #define SC			// 8.2 % if TAGE alone
@@ -29,6 +35,8 @@ long long IMLIcount;		// use to monitor the iteration number
 
 #endif
 
+#define GENTRY_PACKED		// 4-byte TAGE entries (16-bit tag) instead of 12 bytes: same predictions, ~3x smaller tagged tables
+
 
 
 //The statistical corrector components
@@ -45,6 +53,7 @@ int8_t BiasSK[(1 << LOGBIAS)];
 int8_t BiasBank[(1 << LOGBIAS)];
 
 #define INDBIASBANK (pred_inter + (((HitBank+1)/4)<<4) + (HighConf<<1) + (LowConf <<2) +((AltBank!=0)<<3)+ ((PC^(PC>>2))<<7)) & ((1<<LOGBIAS) -1)
+int IBIAS, IBIASSK, IBIASBANK;	// bias indices of the last prediction (reused by PredictAndUpdate)
 
 
 
@@ -55,16 +64,12 @@ int8_t BiasBank[(1 << LOGBIAS)];
 #define LOGINB 8		// 128-entry
 #define INB 1
 int Im[INB] = { 8 };
-int8_t IGEHLA[INB][(1 << LOGINB)] = { {0} };
-
 int8_t *IGEHL[INB];
 
 #define LOGIMNB 9		// 2* 256 -entry
 #define IMNB 2
 
 int IMm[IMNB] = { 10, 4 };
-int8_t IMGEHLA[IMNB][(1 << LOGIMNB)] = { {0} };
-
 int8_t *IMGEHL[IMNB];
 long long IMHIST[256];
 
@@ -74,24 +79,18 @@ long long IMHIST[256];
 #define LOGGNB 10		// 1 1K + 2 * 512-entry tables
 #define GNB 3
 int Gm[GNB] = { 40, 24, 10 };
-int8_t GGEHLA[GNB][(1 << LOGGNB)] = { {0} };
-
 int8_t *GGEHL[GNB];
 
 //variation on global branch history
 #define PNB 3
 #define LOGPNB 9		// 1 1K + 2 * 512-entry tables
 int Pm[PNB] = { 25, 16, 9 };
-int8_t PGEHLA[PNB][(1 << LOGPNB)] = { {0} };
-
 int8_t *PGEHL[PNB];
 
 //first local history
 #define LOGLNB  10		// 1 1K + 2 * 512-entry tables
 #define LNB 3
 int Lm[LNB] = { 11, 6, 3 };
-int8_t LGEHLA[LNB][(1 << LOGLNB)] = { {0} };
-
 int8_t *LGEHL[LNB];
 #define  LOGLOCAL 8
 #define NLOCAL (1<<LOGLOCAL)
@@ -102,8 +101,6 @@ long long L_shist[NLOCAL];	//local histories
 #define LOGSNB 9		// 1 1K + 2 * 512-entry tables
 #define SNB 3
 int Sm[SNB] = { 16, 11, 6 };
-int8_t SGEHLA[SNB][(1 << LOGSNB)] = { {0} };
-
 int8_t *SGEHL[SNB];
 #define LOGSECLOCAL 4
 #define NSECLOCAL (1<<LOGSECLOCAL)	//Number of second local histories
@@ -114,13 +111,42 @@ long long S_slhist[NSECLOCAL];
 #define LOGTNB 10		// 2 * 512-entry tables
 #define TNB 2
 int Tm[TNB] = { 9, 4 };
-int8_t TGEHLA[TNB][(1 << LOGTNB)] = { {0} };
-
 int8_t *TGEHL[TNB];
 #define NTLOCAL 16
 #define INDTLOCAL  (((PC ^ (PC >>(LOGTNB)))) & (NTLOCAL-1))	// different hash for the history
 long long T_slhist[NTLOCAL];
 
+// all the GEHL tables, back to back, so that the SC kernels reach every counter from one base
+struct gehl_store
+{
+#ifdef IMLI
+  int8_t IGEHLA[INB][(1 << LOGINB)];
+  int8_t IMGEHLA[IMNB][(1 << LOGIMNB)];
+#endif
+  int8_t GGEHLA[GNB][(1 << LOGGNB)];
+  int8_t PGEHLA[PNB][(1 << LOGPNB)];
+  int8_t LGEHLA[LNB][(1 << LOGLNB)];
+  int8_t SGEHLA[SNB][(1 << LOGSNB)];
+  int8_t TGEHLA[TNB][(1 << LOGTNB)];
+  int8_t pad[3];		// the vector kernels read 4 bytes per counter
+};
+gehl_store *GEHLS;
+
+// each GEHL table is a lane of the SC kernels; the lanes of a component are consecutive
+#define MAXSCLANES 24		// a multiple of 8
+#define MAXSCCOMP 8
+int NSCLANES;			// number of GEHL tables in use
+int NSCCOMP;			// number of GEHL components in use
+int SCOFF[MAXSCLANES];		// offset of the table in GEHLS
+long long SCHMASK[MAXSCLANES];	// history length mask
+int SCIMASK[MAXSCLANES];	// index mask
+int SCRANK[MAXSCLANES];		// rank of the table in its component (the i of the index hash)
+int SCFIRST[MAXSCCOMP + 1];	// first lane of each component
+int8_t *SCW[MAXSCCOMP];		// VARTHRES weight of each component
+UINT64 SCPC[MAXSCCOMP];		// PC hashed by each component
+int SCIDX[MAXSCLANES];		// counter offsets computed at prediction time, reused at update
+int SCVAL[MAXSCLANES];		// counters read at prediction time (2 * ctr + 1), reused by PredictAndUpdate
+
 
 
 
@@ -164,42 +190,6 @@ bool MedConf;			// is the TAGE prediction medium confidence
 
 
 
-// utility class for index computation
-// this is the cyclic shift register for folding 
-// a long global history into a smaller number of bits; see P. Michaud's PPM-like predictor at CBP-1
-class folded_history
-{
-public:
-
-
-  unsigned comp;
-  int CLENGTH;
-  int OLENGTH;
-  int OUTPOINT;
-
-    folded_history ()
-  {
-  }
-
-
-  void init (int original_length, int compressed_length)
-  {
-    comp = 0;
-    OLENGTH = original_length;
-    CLENGTH = compressed_length;
-    OUTPOINT = OLENGTH % CLENGTH;
-
-  }
-
-  void update (uint8_t * h, int PT)
-  {
-    comp = (comp << 1) ^ h[PT & (HISTBUFFERLENGTH - 1)];
-    comp ^= h[(PT + OLENGTH) & (HISTBUFFERLENGTH - 1)] << OUTPOINT;
-    comp ^= (comp >> CLENGTH);
-    comp = (comp) & ((1 << CLENGTH) - 1);
-  }
-
-};
 
 
 
@@ -222,9 +212,16 @@ public:
 class gentry			// TAGE global table entry
 {
 public:
+#ifdef GENTRY_PACKED
+  // tags are at most TBITS + 4 = 12 bits wide (gtag returns a uint16_t)
+  int8_t ctr;
+  int8_t u;
+  uint16_t tag;
+#else
   int8_t ctr;
   uint tag;
   int8_t u;
+#endif
 
     gentry ()
   {
@@ -242,6 +239,7 @@ public:
 //use geometric history length
 
 #define NHIST 36		// twice the number of different histories
+#define NHISTPAD 48		// per-bank arrays read by the vector tag match are padded to a multiple of 16 banks
 
 #define NBANKLOW 10		// number of banks in the shared bank-interleaved for the low history lengths
 #define NBANKHIGH 20		// number of banks in the shared bank-interleaved for the  history lengths
@@ -263,9 +261,14 @@ int SizeTable[NHIST + 1];
 
 #define LOGG 10			/* logsize of the  banks in the  tagged TAGE tables */
 #define TBITS 8			//minimum width of the tags  (low history lengths), +4 for high history lengths
+#ifdef GENTRY_PACKED
+static_assert (TBITS + 4 <= 16, "GENTRY_PACKED stores tags in 16 bits");
+static_assert (sizeof (gentry) == 4, "GENTRY_PACKED expects a 4-byte gentry");
+#endif
 
 
 bool NOSKIP[NHIST + 1];		// to manage the associativity for different history lengths
+uint64_t NOSKIPMASK;		// NOSKIP as a bit mask (bit i for bank i)
 bool LowConf;
 bool HighConf;
 
@@ -293,22 +296,129 @@ long long GHIST;
 int8_t BIM;
 
 int TICK;			// for the reset of the u counter
-uint8_t ghist[HISTBUFFERLENGTH];
+uint8_t ghist[HISTBUFFERLENGTH + 3];	// +3: read 4 bytes at a time by the vector history update
 int ptghist;
 long long phist;		//path history
-folded_history ch_i[NHIST + 1];	//utility for computing TAGE indices
-folded_history ch_t[2][NHIST + 1];	//utility for computing TAGE tags
+// utility class for index computation
+// this is the cyclic shift register for folding 
+// a long global history into a smaller number of bits; see P. Michaud's PPM-like predictor at CBP-1
+//
+// All the folded histories of TAGE (index, tag and second tag hash of every bank) are kept
+// together as a structure of arrays so that one update sweeps all of them with SIMD.
+#define NFOLD (3 * NHIST)
+#define NFOLDPAD ((NFOLD + 7) & ~7)	// padding slots fold to 0 and are never read
+#define FOLDI(bank) ((bank) - 1)	// slot of the index history of a bank
+#define FOLDT0(bank) (NHIST + (bank) - 1)	// slot of the 1st tag history
+#define FOLDT1(bank) (2 * NHIST + (bank) - 1)	// slot of the 2nd tag history
+
+class folded_histories
+{
+public:
+
+
+  unsigned comp[NFOLDPAD];
+  int CLENGTH[NFOLDPAD];
+  int OLENGTH[NFOLDPAD];
+  int OUTPOINT[NFOLDPAD];
+  unsigned MASK[NFOLDPAD];
+
+    folded_histories ()
+  {
+    memset (this, 0, sizeof (*this));
+  }
+
+
+  void init (int slot, int original_length, int compressed_length)
+  {
+    comp[slot] = 0;
+    OLENGTH[slot] = original_length;
+    CLENGTH[slot] = compressed_length;
+    OUTPOINT[slot] = OLENGTH[slot] % CLENGTH[slot];
+    MASK[slot] = (1 << CLENGTH[slot]) - 1;
+
+  }
+
+  // folds in the n most recent history bits, h[PT + n - 1] being the oldest of them and
+  // h[PT] the newest
+  void update (uint8_t * h, int PT, int n)
+  {
+#ifdef CBP_X86_SIMD
+    if (simdLevel () >= SIMD_AVX2)
+      {
+	update_avx2 (h, PT, n);
+	return;
+      }
+#endif
+    for (int t = n - 1; t >= 0; t--)
+      for (int i = 0; i < NFOLD; i++)
+	{
+	  comp[i] = (comp[i] << 1) ^ h[(PT + t) & (HISTBUFFERLENGTH - 1)];
+	  comp[i] ^=
+	    h[(PT + t + OLENGTH[i]) & (HISTBUFFERLENGTH - 1)] << OUTPOINT[i];
+	  comp[i] ^= (comp[i] >> CLENGTH[i]);
+	  comp[i] = (comp[i]) & MASK[i];
+	}
+  }
+
+#ifdef CBP_X86_SIMD
+// 8 histories per vector; the outgoing bits are gathered 4 bytes at a time, hence the
+// 3 bytes of padding at the end of ghist
+  CBP_TARGET_AVX2 void update_avx2 (uint8_t * h, int PT, int n)
+  {
+    const __m256i wrap = _mm256_set1_epi32 (HISTBUFFERLENGTH - 1);
+    const __m256i byte = _mm256_set1_epi32 (0xff);
+    for (int i = 0; i < NFOLDPAD; i += 8)
+      {
+	__m256i c = _mm256_loadu_si256 ((const __m256i *) &comp[i]);
+	__m256i ol = _mm256_loadu_si256 ((const __m256i *) &OLENGTH[i]);
+	__m256i op = _mm256_loadu_si256 ((const __m256i *) &OUTPOINT[i]);
+	__m256i cl = _mm256_loadu_si256 ((const __m256i *) &CLENGTH[i]);
+	__m256i mk = _mm256_loadu_si256 ((const __m256i *) &MASK[i]);
+	for (int t = n - 1; t >= 0; t--)
+	  {
+	    __m256i in =
+	      _mm256_set1_epi32 (h[(PT + t) & (HISTBUFFERLENGTH - 1)]);
+	    __m256i idx =
+	      _mm256_and_si256 (_mm256_add_epi32
+				(_mm256_set1_epi32 (PT + t), ol), wrap);
+	    __m256i out =
+	      _mm256_and_si256 (_mm256_i32gather_epi32
+				((const int *) h, idx, 1), byte);
+	    c = _mm256_xor_si256 (_mm256_slli_epi32 (c, 1), in);
+	    c = _mm256_xor_si256 (c, _mm256_sllv_epi32 (out, op));
+	    c = _mm256_xor_si256 (c, _mm256_srlv_epi32 (c, cl));
+	    c = _mm256_and_si256 (c, mk);
+	  }
+	_mm256_storeu_si256 ((__m256i *) &comp[i], c);
+      }
+  }
+#endif
+
+};
+folded_histories FH;		//utility for computing TAGE indices and tags
 
 //For the TAGE predictor
 bentry *btable;			//bimodal TAGE table
 gentry *gtable[NHIST + 1];	// tagged TAGE tables
+int GOFF[NHISTPAD + 1];		// offset of gtable[i] from gtable[1]: both halves live in one allocation
+SimdLevel TAGESIMD;		// code path used for the tag match in Tagepred
 int m[NHIST + 1];
 int TB[NHIST + 1];
 int logg[NHIST + 1];
 
-int GI[NHIST + 1];		// indexes to the different tables are computed only once  
-uint GTAG[NHIST + 1];		// tags for the different tables are computed only once  
+int GI[NHISTPAD + 1];		// indexes to the different tables are computed only once  
+uint GTAG[NHISTPAD + 1];	// tags for the different tables are computed only once  
 int BI;				// index of the bimodal table
+
+TableArena TARENA;		// backing store of the tables (see table_arena.h)
+bool USEARENA;
+
+// TAGE indices computed ahead of time by Prefetch (valid until the next history update)
+int PGI[NHISTPAD + 1];
+uint PGTAG[NHISTPAD + 1];
+int PBI;
+UINT64 PIDXPC;
+bool PIDXVALID;
 bool pred_taken;		// prediction
 bool alttaken;			// alternate  TAGEprediction
 bool tage_pred;			// TAGE prediction
@@ -364,8 +474,9 @@ int8_t WITHLOOP;		// counter to monitor whether or not loop prediction is benefi
 
 #endif
 
+// the storage budget in bits; print = false only computes it (e.g. for plugins)
 int
-predictorsize ()
+predictorsize (bool print = true)
 {
   int STORAGESIZE = 0;
   int inter = 0;
@@ -381,12 +492,14 @@ predictorsize ()
   STORAGESIZE += PHISTWIDTH;
   STORAGESIZE += 10;		//the TICK counter
 
-  fprintf (stderr, " (TAGE %d) ", STORAGESIZE);
+  if (print)
+    fprintf (stderr, " (TAGE %d) ", STORAGESIZE);
 #ifdef SC
 #ifdef LOOPPREDICTOR
 
   inter = (1 << LOGL) * (2 * WIDTHNBITERLOOP + LOOPTAG + 4 + 4 + 1);
-  fprintf (stderr, " (LOOP %d) ", inter);
+  if (print)
+    fprintf (stderr, " (LOOP %d) ", inter);
   STORAGESIZE += inter;
 
 #endif
@@ -451,13 +564,17 @@ predictorsize ()
   STORAGESIZE += inter;
 
 
-  fprintf (stderr, " (SC %d) ", inter);
+  if (print)
+    fprintf (stderr, " (SC %d) ", inter);
 #endif
 #ifdef PRINTSIZE
-  fprintf (stderr, " (TOTAL %d bits %d Kbits) ", STORAGESIZE,
-	   STORAGESIZE / 1024);
-  fprintf (stdout, " (TOTAL %d bits %d Kbits) ", STORAGESIZE,
-	   STORAGESIZE / 1024);
+  if (print)
+    {
+      fprintf (stderr, " (TOTAL %d bits %d Kbits) ", STORAGESIZE,
+	       STORAGESIZE / 1024);
+      fprintf (stdout, " (TOTAL %d bits %d Kbits) ", STORAGESIZE,
+	       STORAGESIZE / 1024);
+    }
 #endif
 
 
@@ -471,6 +588,43 @@ predictorsize ()
 
 
 
+// Everything the predictor modifies while running (the tables are added separately).
+// The constructor takes an image of it so that reset() can restore a pristine predictor
+// with a few memcpy instead of going through reinit() again.
+#define PREDICTOR_STATE(X) \
+  X (IMLIcount) X (Bias) X (BiasSK) X (BiasBank) X (IMHIST) \
+  X (L_shist) X (S_slhist) X (T_slhist) X (SCPC) X (SCIDX) X (SCVAL) \
+  X (IBIAS) X (IBIASSK) X (IBIASBANK) \
+  X (updatethreshold) X (Pupdatethreshold) \
+  X (WG) X (WL) X (WS) X (WT) X (WP) X (WI) X (WIM) X (WB) \
+  X (LSUM) X (FirstH) X (SecondH) X (MedConf) X (LowConf) X (HighConf) X (AltConf) \
+  X (use_alt_on_na) X (GHIST) X (BIM) X (TICK) X (ghist) X (ptghist) X (phist) X (FH) \
+  X (GI) X (GTAG) X (BI) X (PGI) X (PGTAG) X (PBI) X (PIDXPC) X (PIDXVALID) \
+  X (pred_taken) X (alttaken) X (tage_pred) X (LongestMatchPred) X (HitBank) X (AltBank) \
+  X (Seed) X (pred_inter) \
+  X (predloop) X (LIB) X (LI) X (LHIT) X (LTAG) X (LVALID) X (WITHLOOP)
+
+// what the table update of a predicted branch needs from its prediction
+#define INFLIGHT_STATE(X) \
+  X (GI) X (GTAG) X (BI) X (HitBank) X (AltBank) X (LongestMatchPred) X (alttaken) \
+  X (tage_pred) X (pred_taken) X (pred_inter) X (LSUM) X (HighConf) X (MedConf) \
+  X (LowConf) X (AltConf) X (SCPC) X (SCIDX) \
+  X (predloop) X (LI) X (LIB) X (LHIT) X (LTAG) X (LVALID)
+
+// a branch predicted but not updated yet (see PREDICTOR::PredictInFlight)
+struct inflight_branch
+{
+  UINT64 PC;
+  bool taken;
+  int THRES;
+#define INFLIGHT_FIELD(v) decltype (::v) v;
+    INFLIGHT_STATE (INFLIGHT_FIELD)
+#undef INFLIGHT_FIELD
+};
+
+std::vector < std::pair < void *, size_t > >STATEREGIONS;
+std::vector < char >STATEIMAGE;
+
 class PREDICTOR
 {
 public:
@@ -479,12 +633,103 @@ public:
     PREDICTOR (void)
   {
 
+// reinit() does not clear every global, so only the first predictor of the process is
+// pristine after it: later ones start from the image of the first
+    bool first = STATEIMAGE.empty ();
     reinit ();
+    stateregions ();
+    if (first)
+      snapshot ();
+    else
+      reset ();
 #ifdef PRINTSIZE
     predictorsize ();
 #endif
   }
 
+// arena tables are reused by the next predictor; malloc'ed ones (CBP_ARENA=0) go with
+// this one, as each new predictor allocates its own (e.g. CBPPlugin::recreate())
+  ~PREDICTOR ()
+  {
+    if (USEARENA)
+      return;
+    delete[]gtable[1];
+    delete[]btable;
+#ifdef LOOPPREDICTOR
+    delete[]ltable;
+#endif
+    delete[]GEHLS;
+    gtable[1] = NULL;
+    btable = NULL;
+  }
+
+// restores the state the predictor had right after construction (e.g. before the next
+// trace of a multi-trace run), without reallocating or recomputing anything
+  void reset ()
+  {
+    load (STATEIMAGE);
+  }
+
+  void stateregions ()
+  {
+    STATEREGIONS.clear ();
+#define STATE_REGION(x) STATEREGIONS.push_back (std::make_pair ((void *) &(x), sizeof (x)));
+    PREDICTOR_STATE (STATE_REGION)
+#undef STATE_REGION
+    STATEREGIONS.push_back (std::make_pair ((void *) &THRES, sizeof (THRES)));
+    STATEREGIONS.push_back (std::make_pair ((void *) gtable[1],
+					    sizeof (gentry) * (NBANKLOW +
+							       NBANKHIGH) *
+					    (1 << LOGG)));
+    STATEREGIONS.push_back (std::make_pair ((void *) btable,
+					    sizeof (bentry) * (1 << LOGB)));
+#ifdef LOOPPREDICTOR
+    STATEREGIONS.push_back (std::make_pair ((void *) ltable,
+					    sizeof (lentry) * (1 << (LOGL))));
+#endif
+    STATEREGIONS.push_back (std::make_pair ((void *) GEHLS,
+					    sizeof (gehl_store)));
+  }
+
+  void snapshot ()
+  {
+    save (STATEIMAGE);
+  }
+
+// copies the whole running state into image, or back from it: lets several simulations
+// share the (global) predictor by swapping their states in and out
+  void save (std::vector < char >&image)
+  {
+    size_t total = 0;
+    for (size_t r = 0; r < STATEREGIONS.size (); r++)
+      total += STATEREGIONS[r].second;
+    image.resize (total);
+    char *img = image.data ();
+    for (size_t r = 0; r < STATEREGIONS.size (); r++)
+      {
+	memcpy (img, STATEREGIONS[r].first, STATEREGIONS[r].second);
+	img += STATEREGIONS[r].second;
+      }
+  }
+
+  void load (const std::vector < char >&image)
+  {
+    const char *img = image.data ();
+    for (size_t r = 0; r < STATEREGIONS.size (); r++)
+      {
+	memcpy (STATEREGIONS[r].first, img, STATEREGIONS[r].second);
+	img += STATEREGIONS[r].second;
+      }
+  }
+
+
+  // a table of n default-constructed entries, from the arena unless CBP_ARENA=0
+  template < class T > T * newtable (size_t n)
+  {
+    if (USEARENA)
+      return TARENA.create < T > (n);
+    return new T[n];
+  }
 
   void reinit ()
   {
@@ -528,28 +773,65 @@ public:
       }
 
 
+// all the tables come from one huge-page backed arena, reused by the next reinit
+    {
+      const char *env = getenv ("CBP_ARENA");
+      USEARENA = (env == NULL) || (strcmp (env, "0") != 0);
+    }
+    if (USEARENA)
+      {
+	TARENA.reserve (TableArena::footprint < gentry >
+			((NBANKLOW + NBANKHIGH) * (1 << LOGG)) +
+			TableArena::footprint < bentry > (1 << LOGB) +
+#ifdef LOOPPREDICTOR
+			TableArena::footprint < lentry > (1 << (LOGL)) +
+#endif
+			TableArena::footprint < gehl_store > (1));
+	TARENA.rewind ();
+      }
+
 #ifdef LOOPPREDICTOR
-    ltable = new lentry[1 << (LOGL)];
+    ltable = newtable < lentry > (1 << (LOGL));
 #endif
+    GEHLS = newtable < gehl_store > (1);
 
 
-    gtable[1] = new gentry[NBANKLOW * (1 << LOGG)];
+// a single allocation for both halves, so that all the banks can be reached from gtable[1]
+    gtable[1] = newtable < gentry > ((NBANKLOW + NBANKHIGH) * (1 << LOGG));
     SizeTable[1] = NBANKLOW * (1 << LOGG);
 
-    gtable[BORN] = new gentry[NBANKHIGH * (1 << LOGG)];
+    gtable[BORN] = gtable[1] + NBANKLOW * (1 << LOGG);
     SizeTable[BORN] = NBANKHIGH * (1 << LOGG);
 
     for (int i = BORN + 1; i <= NHIST; i++)
       gtable[i] = gtable[BORN];
     for (int i = 2; i <= BORN - 1; i++)
       gtable[i] = gtable[1];
-    btable = new bentry[1 << LOGB];
 
+    NOSKIPMASK = 0;
     for (int i = 1; i <= NHIST; i++)
       {
-	ch_i[i].init (m[i], (logg[i]));
-	ch_t[0][i].init (ch_i[i].OLENGTH, TB[i]);
-	ch_t[1][i].init (ch_i[i].OLENGTH, TB[i] - 1);
+	GOFF[i] = gtable[i] - gtable[1];
+	if (NOSKIP[i])
+	  NOSKIPMASK |= (1ULL << i);
+      }
+#if defined(GENTRY_PACKED) && defined(CBP_X86_SIMD)
+    TAGESIMD = simdLevel ();
+// the 16-lane gathers measured slower than the 8-lane ones: only used when asked for
+    if ((TAGESIMD == SIMD_AVX512)
+	&& ((getenv ("CBP_SIMD") == NULL)
+	    || (strcmp (getenv ("CBP_SIMD"), "avx512") != 0)))
+      TAGESIMD = SIMD_AVX2;
+#else
+    TAGESIMD = SIMD_SCALAR;
+#endif
+    btable = newtable < bentry > (1 << LOGB);
+
+    for (int i = 1; i <= NHIST; i++)
+      {
+	FH.init (FOLDI (i), m[i], (logg[i]));
+	FH.init (FOLDT0 (i), m[i], TB[i]);
+	FH.init (FOLDT1 (i), m[i], TB[i] - 1);
 
       }
 #ifdef LOOPPREDICTOR
@@ -570,9 +852,9 @@ public:
     for (int i = 0; i < (1 << LOGSIZEUP); i++)
       Pupdatethreshold[i] = 0;
     for (int i = 0; i < GNB; i++)
-      GGEHL[i] = &GGEHLA[i][0];
+      GGEHL[i] = &GEHLS->GGEHLA[i][0];
     for (int i = 0; i < LNB; i++)
-      LGEHL[i] = &LGEHLA[i][0];
+      LGEHL[i] = &GEHLS->LGEHLA[i][0];
 
     for (int i = 0; i < GNB; i++)
       for (int j = 0; j < ((1 << LOGGNB) - 1); j++)
@@ -594,11 +876,11 @@ public:
 	}
 
     for (int i = 0; i < SNB; i++)
-      SGEHL[i] = &SGEHLA[i][0];
+      SGEHL[i] = &GEHLS->SGEHLA[i][0];
     for (int i = 0; i < TNB; i++)
-      TGEHL[i] = &TGEHLA[i][0];
+      TGEHL[i] = &GEHLS->TGEHLA[i][0];
     for (int i = 0; i < PNB; i++)
-      PGEHL[i] = &PGEHLA[i][0];
+      PGEHL[i] = &GEHLS->PGEHLA[i][0];
 #ifdef IMLI
 #ifdef IMLIOH
     for (int i = 0; i < FNB; i++)
@@ -615,7 +897,7 @@ public:
 	}
 #endif
     for (int i = 0; i < INB; i++)
-      IGEHL[i] = &IGEHLA[i][0];
+      IGEHL[i] = &GEHLS->IGEHLA[i][0];
     for (int i = 0; i < INB; i++)
       for (int j = 0; j < ((1 << LOGINB) - 1); j++)
 	{
@@ -626,7 +908,7 @@ public:
 	    }
 	}
     for (int i = 0; i < IMNB; i++)
-      IMGEHL[i] = &IMGEHLA[i][0];
+      IMGEHL[i] = &GEHLS->IMGEHLA[i][0];
     for (int i = 0; i < IMNB; i++)
       for (int j = 0; j < ((1 << LOGIMNB) - 1); j++)
 	{
@@ -667,6 +949,25 @@ public:
 	}
 
 
+// the SC components, in the order SCinputs provides their inputs
+    NSCLANES = 0;
+    NSCCOMP = 0;
+    SCregister (Gm, GGEHL, GNB, LOGGNB, WG);
+    SCregister (Pm, PGEHL, PNB, LOGPNB, WP);
+#ifdef LOCALH
+    SCregister (Lm, LGEHL, LNB, LOGLNB, WL);
+#ifdef LOCALS
+    SCregister (Sm, SGEHL, SNB, LOGSNB, WS);
+#endif
+#ifdef LOCALT
+    SCregister (Tm, TGEHL, TNB, LOGTNB, WT);
+#endif
+#endif
+#ifdef IMLI
+    SCregister (IMm, IMGEHL, IMNB, LOGIMNB, WIM);
+    SCregister (Im, IGEHL, INB, LOGINB, WI);
+#endif
+
     for (int i = 0; i < (1 << LOGB); i++)
       {
 	btable[i].pred = 0;
@@ -798,22 +1099,21 @@ public:
 
 // gindex computes a full hash of PC, ghist and phist
   int gindex (unsigned int PC, int bank, long long hist,
-	      folded_history * ch_i)
+	      folded_histories & fh)
   {
     int index;
     int M = (m[bank] > PHISTWIDTH) ? PHISTWIDTH : m[bank];
     index =
       PC ^ (PC >> (abs (logg[bank] - bank) + 1))
-      ^ ch_i[bank].comp ^ F (hist, M, bank);
+      ^ fh.comp[FOLDI (bank)] ^ F (hist, M, bank);
 
     return (index & ((1 << (logg[bank])) - 1));
   }
 
   //  tag computation
-  uint16_t gtag (unsigned int PC, int bank, folded_history * ch0,
-		 folded_history * ch1)
+  uint16_t gtag (unsigned int PC, int bank, folded_histories & fh)
   {
-    int tag = (PC) ^ ch0[bank].comp ^ (ch1[bank].comp << 1);
+    int tag = (PC) ^ fh.comp[FOLDT0 (bank)] ^ (fh.comp[FOLDT1 (bank)] << 1);
     return (tag & ((1 << (TB[bank])) - 1));
   }
 
@@ -870,15 +1170,73 @@ public:
   };
 
 
+#if defined(GENTRY_PACKED) && defined(CBP_X86_SIMD)
+// Vector versions of the HitBank/AltBank search: gather the 4-byte entries of all the banks
+// at once (the tag is the upper 16 bits), compare them with GTAG in one go and take the two
+// highest matching banks from the bit mask. Same result as the serial scans.
+  CBP_TARGET_AVX2 void TageMatchAVX2 ()
+  {
+    const int *base = (const int *) gtable[1];
+    uint64_t hits = 0;
+    for (int i = 1; i <= NHIST; i += 8)
+      {
+	__m256i idx =
+	  _mm256_add_epi32 (_mm256_loadu_si256 ((const __m256i *) &GI[i]),
+			    _mm256_loadu_si256 ((const __m256i *) &GOFF[i]));
+	__m256i tag = _mm256_srli_epi32 (_mm256_i32gather_epi32 (base, idx, 4), 16);
+	__m256i eq =
+	  _mm256_cmpeq_epi32 (tag,
+			      _mm256_loadu_si256 ((const __m256i *) &GTAG[i]));
+	hits |=
+	  (uint64_t) (uint8_t) _mm256_movemask_ps (_mm256_castsi256_ps (eq)) << i;
+      }
+    TageMatchSelect (hits & NOSKIPMASK);
+  }
+
+  CBP_TARGET_AVX512 void TageMatchAVX512 ()
+  {
+    const int *base = (const int *) gtable[1];
+    uint64_t hits = 0;
+    for (int i = 1; i <= NHIST; i += 16)
+      {
+	__m512i idx =
+	  _mm512_add_epi32 (_mm512_loadu_si512 (&GI[i]),
+			    _mm512_loadu_si512 (&GOFF[i]));
+	// masked forms: the skipped banks are not loaded, and the pass-through lanes are
+	// zero rather than undefined
+	__mmask16 lanes = (__mmask16) (NOSKIPMASK >> i);
+	__m512i tag =
+	  _mm512_maskz_srli_epi32 (lanes,
+				   _mm512_mask_i32gather_epi32 (_mm512_setzero_si512 (),
+								lanes, idx, base, 4), 16);
+	hits |=
+	  (uint64_t) _mm512_cmpeq_epi32_mask (tag,
+					      _mm512_loadu_si512 (&GTAG[i])) << i;
+      }
+    TageMatchSelect (hits & NOSKIPMASK);
+  }
+
+  CBP_TARGET_AVX2 void TageMatchSelect (uint64_t hits)
+  {
+    if (hits)
+      {
+	HitBank = 63 - _lzcnt_u64 (hits);
+	hits ^= (1ULL << HitBank);
+	if (hits)
+	  AltBank = 63 - _lzcnt_u64 (hits);
+      }
+  }
+#endif
+
   //  TAGE PREDICTION: same code at fetch or retire time but the index and tags must recomputed
-  void Tagepred (UINT64 PC)
+// index phase of the TAGE prediction: computes the table indices and tags, and issues
+// the loads of every bank early so that the misses overlap
+  void Tageindex (UINT64 PC, int *GI, uint * GTAG, int &BI)
   {
-    HitBank = 0;
-    AltBank = 0;
     for (int i = 1; i <= NHIST; i += 2)
       {
-	GI[i] = gindex (PC, i, phist, ch_i);
-	GTAG[i] = gtag (PC, i, ch_t[0], ch_t[1]);
+	GI[i] = gindex (PC, i, phist, FH);
+	GTAG[i] = gtag (PC, i, FH);
 	GTAG[i + 1] = GTAG[i];
 	GI[i + 1] = GI[i] ^ (GTAG[i] & ((1 << LOGG) - 1));
       }
@@ -905,34 +1263,91 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
 //just do not forget most address are aligned on 4 bytes
     BI = (PC ^ (PC >> 2)) & ((1 << LOGB) - 1);
 
+    for (int i = 1; i <= NHIST; i++)
+      if (NOSKIP[i])
+	__builtin_prefetch (&gtable[i][GI[i]]);
+    __builtin_prefetch (&btable[BI]);
+    __builtin_prefetch (&btable[BI >> HYSTSHIFT]);
+  }
+
+// Hint that the next prediction will be for PC. Must be called once the history is final,
+// i.e. after the update of the previous branch: the indices of TAGE and of the SC are
+// computed now and their table entries prefetched, and Tagepred reuses the TAGE ones.
+  void Prefetch (UINT64 PC)
+  {
+    Tageindex (PC, PGI, PGTAG, PBI);
+    PIDXPC = PC;
+    PIDXVALID = true;
+#ifdef SC
+// the SC indices also depend on pred_inter, which only moves the global GEHL entry by one
+    UINT64 cpc[MAXSCCOMP];
+    int idx[MAXSCLANES];
+    SCindices (PC, false, cpc, idx);
+    for (int l = 0; l < NSCLANES; l++)
+      __builtin_prefetch ((int8_t *) GEHLS + idx[l]);
+#endif
+  }
+
+  //  TAGE PREDICTION: consumption phase
+  void Tagepred (UINT64 PC)
+  {
+    HitBank = 0;
+    AltBank = 0;
+    if (PIDXVALID && (PIDXPC == PC))
+      {
+	memcpy (GI, PGI, sizeof (GI));
+	memcpy (GTAG, PGTAG, sizeof (GTAG));
+	BI = PBI;
+      }
+    else
+      Tageindex (PC, GI, GTAG, BI);
+    PIDXVALID = false;
+
     {
       alttaken = getbim ();
       tage_pred = alttaken;
       LongestMatchPred = alttaken;
     }
 
-//Look for the bank with longest matching history
-    for (int i = NHIST; i > 0; i--)
+#if defined(GENTRY_PACKED) && defined(CBP_X86_SIMD)
+    if (TAGESIMD == SIMD_AVX512)
       {
-	if (NOSKIP[i])
-	  if (gtable[i][GI[i]].tag == GTAG[i])
-	    {
-	      HitBank = i;
-	      LongestMatchPred = (gtable[HitBank][GI[HitBank]].ctr >= 0);
-	      break;
-	    }
+	TageMatchAVX512 ();
+	if (HitBank > 0)
+	  LongestMatchPred = (gtable[HitBank][GI[HitBank]].ctr >= 0);
       }
+    else if (TAGESIMD == SIMD_AVX2)
+      {
+	TageMatchAVX2 ();
+	if (HitBank > 0)
+	  LongestMatchPred = (gtable[HitBank][GI[HitBank]].ctr >= 0);
+      }
+    else
+#endif
+      {
+//Look for the bank with longest matching history
+	for (int i = NHIST; i > 0; i--)
+	  {
+	    if (NOSKIP[i])
+	      if (gtable[i][GI[i]].tag == GTAG[i])
+		{
+		  HitBank = i;
+		  LongestMatchPred = (gtable[HitBank][GI[HitBank]].ctr >= 0);
+		  break;
+		}
+	  }
 
 //Look for the alternate bank
-    for (int i = HitBank - 1; i > 0; i--)
-      {
-	if (NOSKIP[i])
-	  if (gtable[i][GI[i]].tag == GTAG[i])
-	    {
+	for (int i = HitBank - 1; i > 0; i--)
+	  {
+	    if (NOSKIP[i])
+	      if (gtable[i][GI[i]].tag == GTAG[i])
+		{
 
-	      AltBank = i;
-	      break;
-	    }
+		  AltBank = i;
+		  break;
+		}
+	  }
       }
 //computes the prediction and the alternate prediction
 
@@ -990,35 +1405,22 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
     LSUM = 0;
 
 //integrate BIAS prediction   
-    int8_t ctr = Bias[INDBIAS];
+    IBIAS = INDBIAS;
+    IBIASSK = INDBIASSK;
+    IBIASBANK = INDBIASBANK;
+    int8_t ctr = Bias[IBIAS];
 
     LSUM += (2 * ctr + 1);
-    ctr = BiasSK[INDBIASSK];
+    ctr = BiasSK[IBIASSK];
     LSUM += (2 * ctr + 1);
-    ctr = BiasBank[INDBIASBANK];
+    ctr = BiasBank[IBIASBANK];
     LSUM += (2 * ctr + 1);
 #ifdef VARTHRES
     LSUM = (1 + (WB[INDUPDS] >= 0)) * LSUM;
 #endif
 //integrate the GEHL predictions
-    LSUM +=
-      Gpredict ((PC << 1) + pred_inter, GHIST, Gm, GGEHL, GNB, LOGGNB, WG);
-    LSUM += Gpredict (PC, phist, Pm, PGEHL, PNB, LOGPNB, WP);
-#ifdef LOCALH
-    LSUM += Gpredict (PC, L_shist[INDLOCAL], Lm, LGEHL, LNB, LOGLNB, WL);
-#ifdef LOCALS
-    LSUM += Gpredict (PC, S_slhist[INDSLOCAL], Sm, SGEHL, SNB, LOGSNB, WS);
-#endif
-#ifdef LOCALT
-    LSUM += Gpredict (PC, T_slhist[INDTLOCAL], Tm, TGEHL, TNB, LOGTNB, WT);
-#endif
-#endif
-
-#ifdef IMLI
-    LSUM +=
-      Gpredict (PC, IMHIST[(IMLIcount)], IMm, IMGEHL, IMNB, LOGIMNB, WIM);
-    LSUM += Gpredict (PC, IMLIcount, Im, IGEHL, INB, LOGINB, WI);
-#endif
+    SCinputs (PC);
+    LSUM += SCpredict ();
     bool SCPRED = (LSUM >= 0);
 //just  an heuristic if the respective contribution of component groups can be multiplied by 2 or not
     THRES = (updatethreshold>>3)+Pupdatethreshold[INDUPD]
@@ -1065,9 +1467,9 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
 
   void HistoryUpdate (UINT64 PC, OpType opType, bool taken,
 		      UINT64 target, long long &X, int &Y,
-		      folded_history * H, folded_history * G,
-		      folded_history * J)
+		      folded_histories & H)
   {
+    PIDXVALID = false;		// the indices computed by Prefetch are stale from now on
     int brtype = 0;
 
     switch (opType)
@@ -1165,19 +1567,12 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
 	Y--;
 	ghist[Y & (HISTBUFFERLENGTH - 1)] = DIR;
 	X = (X << 1) ^ PATHBIT;
-
-
-	for (int i = 1; i <= NHIST; i++)
-	  {
-
-	    H[i].update (ghist, Y);
-	    G[i].update (ghist, Y);
-	    J[i].update (ghist, Y);
-
-
-	  }
       }
 
+// the folded histories only read bits older than the ones just pushed (OLENGTH > maxt),
+// so all the new bits can be folded in at once
+    H.update (ghist, Y, maxt);
+
     X = (X & ((1<<PHISTWIDTH)-1));
     
 //END UPDATE  HISTORIES
@@ -1188,8 +1583,65 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
   void UpdatePredictor (UINT64 PC, OpType opType, bool resolveDir,
 			bool predDir, UINT64 branchTarget)
   {
+    UpdateTables (PC, resolveDir, false);
+    HistoryUpdate (PC, opType, resolveDir, branchTarget, phist, ptghist, FH);
+  }
 
+// trace-driven simulation knows the outcome when it asks for the prediction: predict and
+// update in one call, the update reusing the bias indices and SC counters read by the
+// prediction instead of recomputing them (rec.predDir is filled in)
+  bool PredictAndUpdate (cbp_branch_record & rec)
+  {
+    if (!rec.conditional)
+      {
+	TrackOtherInst (rec.PC, (OpType) rec.opType, rec.branchTaken,
+			rec.branchTarget);
+	return rec.predDir;
+      }
+    rec.predDir = GetPrediction (rec.PC);
+    UpdateTables (rec.PC, rec.branchTaken, true);
+    HistoryUpdate (rec.PC, (OpType) rec.opType, rec.branchTaken,
+		   rec.branchTarget, phist, ptghist, FH);
+    return rec.predDir;
+  }
 
+// pipelined simulation: the branch is predicted with the history of all the older
+// branches, but its tables are only updated once it retires, several predictions later
+// (UpdateInFlight). The trace holds no wrong-path branches, so repairing the history on a
+// misprediction amounts to pushing the resolved direction right away.
+  bool PredictInFlight (cbp_branch_record & rec, inflight_branch & b)
+  {
+    rec.predDir = GetPrediction (rec.PC);
+    b.PC = rec.PC;
+    b.taken = rec.branchTaken;
+    b.THRES = THRES;
+#define INFLIGHT_SAVE(v) memcpy (&b.v, &v, sizeof (v));
+    INFLIGHT_STATE (INFLIGHT_SAVE)
+#undef INFLIGHT_SAVE
+      HistoryUpdate (rec.PC, (OpType) rec.opType, rec.branchTaken,
+		     rec.branchTarget, phist, ptghist, FH);
+    return rec.predDir;
+  }
+
+// the counters are read again: younger branches may have updated them meanwhile
+  void UpdateInFlight (const inflight_branch & b)
+  {
+    THRES = b.THRES;
+#define INFLIGHT_LOAD(v) memcpy (&v, &b.v, sizeof (v));
+    INFLIGHT_STATE (INFLIGHT_LOAD)
+#undef INFLIGHT_LOAD
+      UpdateTables (b.PC, b.taken, false);
+  }
+
+// fused: called right after GetPrediction for the same branch, so the values it cached
+// are still current
+  void UpdateTables (UINT64 PC, bool resolveDir, bool fused)
+  {
+#ifdef SC
+    int ibias = fused ? IBIAS : (INDBIAS);
+    int ibiassk = fused ? IBIASSK : (INDBIASSK);
+    int ibiasbank = fused ? IBIASBANK : (INDBIASBANK);
+#endif
 
 #ifdef SC
 #ifdef LOOPPREDICTOR
@@ -1246,45 +1698,23 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
 #ifdef VARTHRES
 	{
 	  int XSUM =
-	    LSUM - ((WB[INDUPDS] >= 0) * ((2 * Bias[INDBIAS] + 1) +
-					  (2 * BiasSK[INDBIASSK] + 1) +
-					  (2 * BiasBank[INDBIASBANK] + 1)));
+	    LSUM - ((WB[INDUPDS] >= 0) * ((2 * Bias[ibias] + 1) +
+					  (2 * BiasSK[ibiassk] + 1) +
+					  (2 * BiasBank[ibiasbank] + 1)));
 	  if ((XSUM +
-	       ((2 * Bias[INDBIAS] + 1) + (2 * BiasSK[INDBIASSK] + 1) +
-		(2 * BiasBank[INDBIASBANK] + 1)) >= 0) != (XSUM >= 0))
+	       ((2 * Bias[ibias] + 1) + (2 * BiasSK[ibiassk] + 1) +
+		(2 * BiasBank[ibiasbank] + 1)) >= 0) != (XSUM >= 0))
 	    ctrupdate (WB[INDUPDS],
-		       (((2 * Bias[INDBIAS] + 1) +
-			 (2 * BiasSK[INDBIASSK] + 1) +
-			 (2 * BiasBank[INDBIASBANK] + 1) >= 0) == resolveDir),
+		       (((2 * Bias[ibias] + 1) +
+			 (2 * BiasSK[ibiassk] + 1) +
+			 (2 * BiasBank[ibiasbank] + 1) >= 0) == resolveDir),
 		       EWIDTH);
 	}
 #endif
-	ctrupdate (Bias[INDBIAS], resolveDir, PERCWIDTH);
-	ctrupdate (BiasSK[INDBIASSK], resolveDir, PERCWIDTH);
-	ctrupdate (BiasBank[INDBIASBANK], resolveDir, PERCWIDTH);
-	Gupdate ((PC << 1) + pred_inter, resolveDir,
-		 GHIST, Gm, GGEHL, GNB, LOGGNB, WG);
-	Gupdate (PC, resolveDir, phist, Pm, PGEHL, PNB, LOGPNB, WP);
-#ifdef LOCALH
-	Gupdate (PC, resolveDir, L_shist[INDLOCAL], Lm, LGEHL, LNB, LOGLNB,
-		 WL);
-#ifdef LOCALS
-	Gupdate (PC, resolveDir, S_slhist[INDSLOCAL], Sm,
-		 SGEHL, SNB, LOGSNB, WS);
-#endif
-#ifdef LOCALT
-
-	Gupdate (PC, resolveDir, T_slhist[INDTLOCAL], Tm, TGEHL, TNB, LOGTNB,
-		 WT);
-#endif
-#endif
-
-
-#ifdef IMLI
-	Gupdate (PC, resolveDir, IMHIST[(IMLIcount)], IMm, IMGEHL, IMNB,
-		 LOGIMNB, WIM);
-	Gupdate (PC, resolveDir, IMLIcount, Im, IGEHL, INB, LOGINB, WI);
-#endif
+	ctrupdate (Bias[ibias], resolveDir, PERCWIDTH);
+	ctrupdate (BiasSK[ibiassk], resolveDir, PERCWIDTH);
+	ctrupdate (BiasBank[ibiasbank], resolveDir, PERCWIDTH);
+	SCupdate (resolveDir, fused);
 
 
 
@@ -1498,58 +1928,185 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
 //END TAGE UPDATE
 
 
-    HistoryUpdate (PC, opType, resolveDir, branchTarget,
-		   phist, ptghist, ch_i, ch_t[0], ch_t[1]);
-
-
-//END PREDICTOR UPDATE
-
-
   }
-#define GINDEX (((long long) PC) ^ bhist ^ (bhist >> (8 - i)) ^ (bhist >> (16 - 2 * i)) ^ (bhist >> (24 - 3 * i)) ^ (bhist >> (32 - 3 * i)) ^ (bhist >> (40 - 4 * i))) & ((1 << (logs - (i >= (NBR - 2)))) - 1)
-  int Gpredict (UINT64 PC, long long BHIST, int *length,
-		int8_t ** tab, int NBR, int logs, int8_t * W)
+// The GEHL components of the statistical corrector, handled as lanes (one per table).
+// The indices are computed once per prediction (SCinputs) and reused at update time.
+#define GINDEX (((long long) PC) ^ bhist ^ (bhist >> (8 - i)) ^ (bhist >> (16 - 2 * i)) ^ (bhist >> (24 - 3 * i)) ^ (bhist >> (32 - 3 * i)) ^ (bhist >> (40 - 4 * i))) & imask
+
+  void SCregister (int *length, int8_t ** tab, int NBR, int logs, int8_t * W)
   {
-    int PERCSUM = 0;
+    assert (NSCCOMP < MAXSCCOMP && NSCLANES + NBR <= MAXSCLANES);
+    SCFIRST[NSCCOMP] = NSCLANES;
+    SCW[NSCCOMP] = W;
     for (int i = 0; i < NBR; i++)
       {
-	long long bhist = BHIST & ((long long) ((1 << length[i]) - 1));
-	long long index = GINDEX;
+	SCOFF[NSCLANES] = tab[i] - (int8_t *) GEHLS;
+	SCHMASK[NSCLANES] = ((long long) ((1 << length[i]) - 1));
+	SCIMASK[NSCLANES] = ((1 << (logs - (i >= (NBR - 2)))) - 1);
+	SCRANK[NSCLANES] = i;
+	NSCLANES++;
+      }
+    NSCCOMP++;
+    SCFIRST[NSCCOMP] = NSCLANES;
+  }
 
-	int8_t ctr = tab[i][index];
+  // hashes the PC and history of each component (in SCregister order) into the counter
+  // offsets of all the lanes; inter stands for pred_inter
+  void SCindices (UINT64 PC, bool inter, UINT64 * cpc, int *idx)
+  {
+    long long chist[MAXSCCOMP];
+    int n = 0;
+    cpc[n] = (PC << 1) + inter;
+    chist[n++] = GHIST;
+    cpc[n] = PC;
+    chist[n++] = phist;
+#ifdef LOCALH
+    cpc[n] = PC;
+    chist[n++] = L_shist[INDLOCAL];
+#ifdef LOCALS
+    cpc[n] = PC;
+    chist[n++] = S_slhist[INDSLOCAL];
+#endif
+#ifdef LOCALT
+    cpc[n] = PC;
+    chist[n++] = T_slhist[INDTLOCAL];
+#endif
+#endif
+#ifdef IMLI
+    cpc[n] = PC;
+    chist[n++] = IMHIST[(IMLIcount)];
+    cpc[n] = PC;
+    chist[n++] = IMLIcount;
+#endif
+    assert (n == NSCCOMP);
 
-	PERCSUM += (2 * ctr + 1);
+    for (int c = 0; c < NSCCOMP; c++)
+      for (int l = SCFIRST[c]; l < SCFIRST[c + 1]; l++)
+	{
+	  UINT64 PC = cpc[c];
+	  long long bhist = chist[c] & SCHMASK[l];
+	  int i = SCRANK[l];
+	  int imask = SCIMASK[l];
+	  idx[l] = SCOFF[l] + (int) (GINDEX);
+	}
+  }
 
+  void SCinputs (UINT64 PC)
+  {
+    SCindices (PC, pred_inter, SCPC, SCIDX);
+  }
 
+  // reads the counters of all the lanes as 2 * ctr + 1
+  void SCread (int *val)
+  {
+#ifdef CBP_X86_SIMD
+    if (simdLevel () >= SIMD_AVX2)
+      {
+	SCread_avx2 (val);
+	return;
       }
-#ifdef VARTHRES
-    PERCSUM = (1 + (W[INDUPDS] >= 0)) * PERCSUM;
 #endif
-    return ((PERCSUM));
+    const int8_t *base = (const int8_t *) GEHLS;
+    for (int l = 0; l < NSCLANES; l++)
+      val[l] = 2 * base[SCIDX[l]] + 1;
   }
-  void Gupdate (UINT64 PC, bool taken, long long BHIST, int *length,
-		int8_t ** tab, int NBR, int logs, int8_t * W)
-  {
-
-    int PERCSUM = 0;
 
-    for (int i = 0; i < NBR; i++)
+  int SCpredict ()
+  {
+    int *val = SCVAL;
+    int SUM = 0;
+    SCread (val);
+    for (int c = 0; c < NSCCOMP; c++)
       {
-	long long bhist = BHIST & ((long long) ((1 << length[i]) - 1));
-	long long index = GINDEX;
+	int PERCSUM = 0;
+	for (int l = SCFIRST[c]; l < SCFIRST[c + 1]; l++)
+	  PERCSUM += val[l];
+#ifdef VARTHRES
+	UINT64 PC = SCPC[c];	// INDUPDS hashes the PC of the component, as Gpredict did
+	PERCSUM = (1 + (SCW[c][INDUPDS] >= 0)) * PERCSUM;
+#endif
+	SUM += PERCSUM;
+      }
+    return (SUM);
+  }
 
-	PERCSUM += (2 * tab[i][index] + 1);
-	ctrupdate (tab[i][index], taken, PERCWIDTH);
+// reuse: the counters have not changed since SCpredict read them into SCVAL
+  void SCupdate (bool taken, bool reuse)
+  {
+    int fresh[MAXSCLANES];
+    const int *val = SCVAL;
+    if (!reuse)
+      {
+	SCread (fresh);
+	val = fresh;
       }
+    for (int c = 0; c < NSCCOMP; c++)
+      {
+	int PERCSUM = 0;
+	for (int l = SCFIRST[c]; l < SCFIRST[c + 1]; l++)
+	  PERCSUM += val[l];
 #ifdef VARTHRES
-    {
-      int XSUM = LSUM - ((W[INDUPDS] >= 0)) * PERCSUM;
-      if ((XSUM + PERCSUM >= 0) != (XSUM >= 0))
-	ctrupdate (W[INDUPDS], ((PERCSUM >= 0) == taken), EWIDTH);
-    }
+	{
+	  int8_t *W = SCW[c];
+	  UINT64 PC = SCPC[c];
+	  int XSUM = LSUM - ((W[INDUPDS] >= 0)) * PERCSUM;
+	  if ((XSUM + PERCSUM >= 0) != (XSUM >= 0))
+	    ctrupdate (W[INDUPDS], ((PERCSUM >= 0) == taken), EWIDTH);
+	}
 #endif
+      }
+#ifdef CBP_X86_SIMD
+    if (simdLevel () >= SIMD_AVX2)
+      {
+	SCsat_avx2 (val, taken);
+	return;
+      }
+#endif
+    int8_t *base = (int8_t *) GEHLS;
+    for (int l = 0; l < NSCLANES; l++)
+      ctrupdate (base[SCIDX[l]], taken, PERCWIDTH);
+  }
+
+#ifdef CBP_X86_SIMD
+  CBP_TARGET_AVX2 void SCread_avx2 (int *val)
+  {
+    const int *base = (const int *) GEHLS;
+    for (int l = 0; l < NSCLANES; l += 8)
+      {
+	__m256i idx = _mm256_loadu_si256 ((const __m256i *) &SCIDX[l]);
+	__m256i ctr = _mm256_i32gather_epi32 (base, idx, 1);
+	ctr = _mm256_srai_epi32 (_mm256_slli_epi32 (ctr, 24), 24);	// sign-extend the low byte
+	_mm256_storeu_si256 ((__m256i *) & val[l],
+			     _mm256_add_epi32 (_mm256_add_epi32 (ctr, ctr),
+					       _mm256_set1_epi32 (1)));
+      }
   }
 
+  // saturating PERCWIDTH-bit update of the counters read by SCread_avx2 (still 2 * ctr + 1)
+  CBP_TARGET_AVX2 void SCsat_avx2 (const int *val, bool taken)
+  {
+    int8_t *base = (int8_t *) GEHLS;
+    int ctr[MAXSCLANES];
+    for (int l = 0; l < NSCLANES; l += 8)
+      {
+	__m256i c =
+	  _mm256_srai_epi32 (_mm256_loadu_si256 ((const __m256i *) &val[l]),
+			     1);
+	if (taken)
+	  c = _mm256_min_epi32 (_mm256_add_epi32 (c, _mm256_set1_epi32 (1)),
+				_mm256_set1_epi32 ((1 << (PERCWIDTH - 1)) -
+						   1));
+	else
+	  c = _mm256_max_epi32 (_mm256_sub_epi32 (c, _mm256_set1_epi32 (1)),
+				_mm256_set1_epi32 (-(1 << (PERCWIDTH - 1))));
+	_mm256_storeu_si256 ((__m256i *) & ctr[l], c);
+      }
+    // byte scatter: lanes are in distinct tables, but 4-byte stores would clobber neighbours
+    for (int l = 0; l < NSCLANES; l++)
+      base[SCIDX[l]] = ctr[l];
+  }
+#endif
+
 
   void TrackOtherInst (UINT64 PC, OpType opType, bool taken,
 		       UINT64 branchTarget)
@@ -1557,7 +2114,7 @@ int T = (PC ^ (phist & ((1 << m[BORN]) - 1))) % NBANKHIGH;
 
 
     HistoryUpdate (PC, opType, taken, branchTarget, phist,
-		   ptghist, ch_i, ch_t[0], ch_t[1]);
+		   ptghist, FH);
 
 
 
@@ -9,14 +9,26 @@
 #include <fstream>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 using namespace std;
 
 #include "utils.h"
 #include "bt9_reader.h"
+#include "branch_decode.h"
+#include "cbp_plugin_loader.h"
+#include "decode_ahead.h"
+#include "npy_writer.h"
+#include "perf_counters.h"
 #include "predictor.h"
+#include "sim_regions.h"
+#include "feature_export.h"
 
 
 #define COUNTER     unsigned long long
@@ -112,50 +124,107 @@ struct BinDataPoint {
 };
 #endif
 
-// usage: predictor <trace>
+// number of pre-decoded branches handed to a plugin per call
+#define PLUGIN_BATCH_SIZE 1024
 
-int main(int argc, char *argv[]) {
+// Statistics and logs of one simulation run
+struct SimState {
+    UINT64 numIter = 0;
+    UINT64 numMispred = 0;
+    UINT64 cond_branch_instruction_counter = 0;
+    UINT64 uncond_branch_instruction_counter = 0;
+#ifdef SAVE_CSV
+    std::ofstream csvFile;
+#endif
+#ifdef SAVE_BINARY
+    ofstream binFile;
+    BinDataPoint dp;
+#endif
+};
 
-    if (argc != 2) {
-        printf("usage: %s <trace>\n", argv[0]);
-        exit(-1);
+// Account for one simulated branch; must be called in trace order
+void RecordBranch(SimState &sim, const cbp_branch_record &rec) {
+    CheckHeartBeat(++sim.numIter, sim.numMispred); //Here numIter will be equal to number of branches read
+
+#ifdef SAVE_BINARY
+    sim.dp.PC = rec.PC;
+#endif
+
+    if (rec.conditional) { //JD2_17_2016 call UpdatePredictor() for all branches that decode as conditional
+#ifdef SAVE_CSV
+        //PC,conditional,branchTaken,predDir,opType,branchTarget
+        sim.csvFile << std::to_string(rec.PC) + ",1," + std::to_string(rec.branchTaken) + "," +
+                       std::to_string(rec.predDir) + "," + std::to_string(rec.opType) + "," +
+                       std::to_string(rec.branchTarget) + "\n";
+#endif
+#ifdef SAVE_BINARY
+        sim.dp.conditional = true;
+        sim.dp.branchTaken = rec.branchTaken;
+        sim.dp.predDir = rec.predDir;
+        sim.dp.opType = (OpType) rec.opType;
+        sim.dp.branchTarget = rec.branchTarget;
+        sim.binFile.write((char *) &sim.dp, sizeof(BinDataPoint));
+#endif
+
+        if (rec.predDir != rec.branchTaken) {
+            sim.numMispred++; // update mispred stats
+        }
+        sim.cond_branch_instruction_counter++;
+    } else { // for predictors that want to track unconditional branches
+        sim.uncond_branch_instruction_counter++;
+#ifdef SAVE_CSV
+        //PC,conditional,branchTaken,_,opType,branchTarget
+        sim.csvFile << std::to_string(rec.PC) + ",0," + std::to_string(rec.branchTaken) + ",," +
+                       std::to_string(rec.opType) + "," + std::to_string(rec.branchTarget) + "\n";
+#endif
+#ifdef SAVE_BINARY
+        // NOTE: must ignore predDir here (unconditional branch...)
+        sim.dp.conditional = false;
+        sim.dp.branchTaken = rec.branchTaken;
+        sim.dp.opType = (OpType) rec.opType;
+        sim.dp.branchTarget = rec.branchTarget;
+        sim.binFile.write((char *) &sim.dp, sizeof(BinDataPoint));
+#endif
     }
+}
 
-    ///////////////////////////////////////////////
-    // Init variables
-    ///////////////////////////////////////////////
+// Run a batch of pre-decoded branches through a plugin, then account for them
+void FlushPluginBatch(SimState &sim, CBPPlugin *plugin, cbp_branch_record *batch, size_t &n) {
+    plugin->ProcessBatch(batch, n);
+    for (size_t i = 0; i < n; i++) {
+        RecordBranch(sim, batch[i]);
+    }
+    n = 0;
+}
+
+// Simulate one trace with the built-in predictor (brpred) or a plugin, and print its stats.
+// With update_delay > 0 the built-in predictor only updates a conditional branch after
+// update_delay younger ones were predicted; inflight holds update_delay + 1 entries.
+int SimulateTrace(const std::string &trace_path, PREDICTOR *brpred, CBPPlugin *plugin,
+                  int update_delay, inflight_branch *inflight) {
 
     ///////////////////////////////////////////////
-    // read each trace recrod, simulate until done
+    // Init variables
     ///////////////////////////////////////////////
 
-    std::string trace_path;
-    trace_path = argv[1];
+    SimState sim;
 
 #ifdef SAVE_CSV
-    std::ofstream csvFile;
-    csvFile.open(trace_path + ".csv");
+    sim.csvFile.open(trace_path + ".csv");
 
-    csvFile << "PC,conditional,branchTaken,predDir,opType,branchTarget\n";
+    sim.csvFile << "PC,conditional,branchTaken,predDir,opType,branchTarget\n";
 #endif
 
 #ifdef SAVE_BINARY
-    ofstream binFile(trace_path + ".dat", ios::out | ios::binary);
-    if (!binFile) {
+    sim.binFile.open(trace_path + ".dat", ios::out | ios::binary);
+    if (!sim.binFile) {
         std::cout << "Cannot open file!" << std::endl;
         return 1;
     }
-    BinDataPoint dp;
-    std::cout << "Size of BinDataPoint: " << sizeof(BinDataPoint) << std::endl;
-    std::cout << "    branchTaken:  " << sizeof(dp.branchTaken) << '(' << &dp.branchTaken << ')' << std::endl;
-    std::cout << "    predDir:      " << sizeof(dp.predDir) << '(' << &dp.predDir << ')' << std::endl;
-    std::cout << "    conditional:  " << sizeof(dp.conditional) << '(' << &dp.conditional << ')' << std::endl;
-    std::cout << "    opType:       " << sizeof(dp.opType) << '(' << &dp.opType << ')' << std::endl;
-    std::cout << "    branchTarget: " << sizeof(dp.branchTarget) << '(' << &dp.branchTarget << ')' << std::endl;
-    std::cout << "    PC:           " << sizeof(dp.PC) << '(' << &dp.PC << ')' << std::endl;
 #endif
 
-    PREDICTOR *brpred = new PREDICTOR();  // this instantiates the predictor code
+    cbp_branch_record batch[PLUGIN_BATCH_SIZE];
+    size_t batch_size = 0;
 
     bt9::BT9Reader bt9_reader(trace_path);
 
@@ -166,156 +235,74 @@ int main(int argc, char *argv[]) {
     key = "branch_instruction_count:";
     bt9_reader.header.getFieldValueStr(key, value);
     UINT64 branch_instruction_counter = std::stoull(value, nullptr, 0);
-    UINT64 numMispred = 0;
-
-    UINT64 cond_branch_instruction_counter = 0;
-    UINT64 uncond_branch_instruction_counter = 0;
 
     ///////////////////////////////////////////////
     // read each trace record, simulate until done
     ///////////////////////////////////////////////
 
-    OpType opType;
-    UINT64 PC;
-    bool branchTaken;
-    UINT64 branchTarget;
-    UINT64 numIter = 0;
+    // data TLB misses of the simulation loop (CBP_ARENA=0 gives the figure without the arena)
+    PerfCounter *dtlb_misses = PerfCounter::dtlbLoadMisses();
+    dtlb_misses->start();
 
-    for (auto it = bt9_reader.begin(); it != bt9_reader.end(); ++it) {
-        CheckHeartBeat(++numIter, numMispred); //Here numIter will be equal to number of branches read
+    cbp_branch_record rec;
+    // the built-in predictor path records each branch one iteration late, so that the
+    // bookkeeping overlaps with the table loads prefetched for the next branch
+    cbp_branch_record prev_rec;
+    bool have_prev = false;
+    // FIFO of the branches in flight: oldest at inflight_head
+    int inflight_head = 0;
+    int inflight_count = 0;
 
+    for (auto it = bt9_reader.begin(); it != bt9_reader.end(); ++it) {
         try {
-            bt9::BrClass br_class = it->getSrcNode()->brClass();
-
-//JD2_2_2016 break down branch instructions into all possible types
-            opType = OPTYPE_ERROR;
-
-            if ((br_class.type == bt9::BrClass::Type::UNKNOWN) &&
-                (it->getSrcNode()->brNodeIndex())) { //only fault if it isn't the first node in the graph (fake branch)
-                opType = OPTYPE_ERROR; //sanity check
-            } else if (br_class.type == bt9::BrClass::Type::RET) {
-                if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL)
-                    opType = OPTYPE_RET_COND;
-                else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL)
-                    opType = OPTYPE_RET_UNCOND;
-                else {
-                    opType = OPTYPE_ERROR;
-                }
-            } else if (br_class.directness == bt9::BrClass::Directness::INDIRECT) {
-                if (br_class.type == bt9::BrClass::Type::CALL) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL)
-                        opType = OPTYPE_CALL_INDIRECT_COND;
-                    else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL)
-                        opType = OPTYPE_CALL_INDIRECT_UNCOND;
-                    else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else if (br_class.type == bt9::BrClass::Type::JMP) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL)
-                        opType = OPTYPE_JMP_INDIRECT_COND;
-                    else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL)
-                        opType = OPTYPE_JMP_INDIRECT_UNCOND;
-                    else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else {
-                    opType = OPTYPE_ERROR;
+            if (!decodeBranchRecord(*it, rec)) {
+                // the first node in the graph (fake branch): nothing to simulate
+                if (plugin) {
+                    FlushPluginBatch(sim, plugin, batch, batch_size);
                 }
-            } else if (br_class.directness == bt9::BrClass::Directness::DIRECT) {
-                if (br_class.type == bt9::BrClass::Type::CALL) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL) {
-                        opType = OPTYPE_CALL_DIRECT_COND;
-                    } else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL) {
-                        opType = OPTYPE_CALL_DIRECT_UNCOND;
-                    } else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else if (br_class.type == bt9::BrClass::Type::JMP) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL) {
-                        opType = OPTYPE_JMP_DIRECT_COND;
-                    } else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL) {
-                        opType = OPTYPE_JMP_DIRECT_UNCOND;
-                    } else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else {
-                    opType = OPTYPE_ERROR;
+                if (have_prev) {
+                    RecordBranch(sim, prev_rec);
+                    have_prev = false;
                 }
-            } else {
-                opType = OPTYPE_ERROR;
-            }
-
-            PC = it->getSrcNode()->brVirtualAddr();
-
-            branchTaken = it->getEdge()->isTakenPath();
-            branchTarget = it->getEdge()->brVirtualTarget();
-
-/************************************************************************************************************/
+                CheckHeartBeat(++sim.numIter, sim.numMispred);
 #ifdef SAVE_CSV
-            csvFile << std::to_string(PC) + ","; //PC
+                sim.csvFile << std::to_string(it->getSrcNode()->brVirtualAddr()) + ",,,,,\n"; //nothing else to see here
 #endif
+                continue;
+            }
 
-#ifdef SAVE_BINARY
-            dp.PC = PC;
-#endif
+/************************************************************************************************************/
 
-            if (opType == OPTYPE_ERROR) {
-                if (it->getSrcNode()->brNodeIndex()) { //only fault if it isn't the first node in the graph (fake branch)
-                    fprintf(stderr, "OPTYPE_ERROR\n");
-                    printf("OPTYPE_ERROR\n");
-                    exit(-1); //this should never happen, if it does please email CBP org chair.
+            if (plugin) {
+                batch[batch_size++] = rec;
+                if (batch_size == PLUGIN_BATCH_SIZE) {
+                    FlushPluginBatch(sim, plugin, batch, batch_size);
                 }
-#ifdef SAVE_CSV
-                csvFile << ",,,,\n"; //nothing else to see here
-#endif
-            } else if (br_class.conditionality ==
-                       bt9::BrClass::Conditionality::CONDITIONAL) { //JD2_17_2016 call UpdatePredictor() for all branches that decode as conditional
-
-                bool predDir = false;
-
-                predDir = brpred->GetPrediction(PC);
-                brpred->UpdatePredictor(PC, opType, branchTaken, predDir, branchTarget);
+                continue;
+            }
 
-#ifdef SAVE_CSV
-                //conditional,branchTaken,predDir,opType,branchTarget
-                csvFile << "1," + std::to_string(branchTaken) + "," + std::to_string(predDir) +
-                    "," + std::to_string(opType) + "," + std::to_string(branchTarget) + "\n";
-#endif
-#ifdef SAVE_BINARY
-                dp.conditional = true;
-                dp.branchTaken = branchTaken;
-                dp.predDir = predDir;
-                dp.opType = opType;
-                dp.branchTarget = branchTarget;
-                binFile.write((char *) &dp, sizeof(BinDataPoint));
-#endif
+            if (rec.conditional) {
+                brpred->Prefetch(rec.PC);
+            }
+            if (have_prev) {
+                RecordBranch(sim, prev_rec);
+            }
 
-                if (predDir != branchTaken) {
-                    numMispred++; // update mispred stats
+            if (update_delay == 0) {
+                brpred->PredictAndUpdate(rec);
+            } else if (rec.conditional) {
+                brpred->PredictInFlight(rec, inflight[(inflight_head + inflight_count) % (update_delay + 1)]);
+                if (++inflight_count > update_delay) {
+                    // update_delay younger branches were predicted: the oldest one retires
+                    brpred->UpdateInFlight(inflight[inflight_head]);
+                    inflight_head = (inflight_head + 1) % (update_delay + 1);
+                    inflight_count--;
                 }
-                cond_branch_instruction_counter++;
-            } else if (br_class.conditionality ==
-                       bt9::BrClass::Conditionality::UNCONDITIONAL) { // for predictors that want to track unconditional branches
-                uncond_branch_instruction_counter++;
-                brpred->TrackOtherInst(PC, opType, branchTaken, branchTarget);
-#ifdef SAVE_CSV
-                //conditional,branchTaken,_,opType,branchTarget
-                csvFile << "0," + std::to_string(branchTaken) + ",," +
-                       std::to_string(opType) + "," + std::to_string(branchTarget) + "\n";
-#endif
-#ifdef SAVE_BINARY
-                // NOTE: must ignore predDir here (unconditional branch...)
-                dp.conditional = false;
-                dp.branchTaken = branchTaken;
-                dp.opType = opType;
-                dp.branchTarget = branchTarget;
-                binFile.write((char *) &dp, sizeof(BinDataPoint));
-#endif
             } else {
-                fprintf(stderr, "CONDITIONALITY ERROR\n");
-                printf("CONDITIONALITY ERROR\n");
-                exit(-1); //this should never happen, if it does please email CBP org chair.
+                brpred->TrackOtherInst(rec.PC, (OpType) rec.opType, rec.branchTaken, rec.branchTarget);
             }
+            prev_rec = rec;
+            have_prev = true;
 
 /************************************************************************************************************/
         }
@@ -326,13 +313,25 @@ int main(int argc, char *argv[]) {
 
     } //for (auto it = bt9_reader.begin(); it != bt9_reader.end(); ++it)
 
+    if (have_prev) {
+        RecordBranch(sim, prev_rec);
+    }
+    if (plugin) {
+        FlushPluginBatch(sim, plugin, batch, batch_size);
+    }
+    for (; inflight_count > 0; inflight_count--) {
+        brpred->UpdateInFlight(inflight[inflight_head]);
+        inflight_head = (inflight_head + 1) % (update_delay + 1);
+    }
+    dtlb_misses->stop();
+
 #ifdef SAVE_CSV
-    csvFile.close();
+    sim.csvFile.close();
 #endif
 
 #ifdef SAVE_BINARY
-    binFile.close();
-    if (!binFile.good()) {
+    sim.binFile.close();
+    if (!sim.binFile.good()) {
         std::cout << "Error occurred at writing time!" << std::endl;
         return 1;
     }
@@ -348,10 +347,486 @@ int main(int argc, char *argv[]) {
     printf("  NUM_INSTRUCTIONS            \t : %10llu", total_instruction_counter);
     printf("  NUM_BR                      \t : %10llu",
            branch_instruction_counter - 1); //JD2_2_2016 NOTE there is a dummy branch at the beginning of the trace...
-    printf("  NUM_UNCOND_BR               \t : %10llu", uncond_branch_instruction_counter);
-    printf("  NUM_CONDITIONAL_BR          \t : %10llu", cond_branch_instruction_counter);
-    printf("  NUM_MISPREDICTIONS          \t : %10llu", numMispred);
+    printf("  NUM_UNCOND_BR               \t : %10llu", sim.uncond_branch_instruction_counter);
+    printf("  NUM_CONDITIONAL_BR          \t : %10llu", sim.cond_branch_instruction_counter);
+    printf("  NUM_MISPREDICTIONS          \t : %10llu", sim.numMispred);
     printf("  MISPRED_PER_1K_INST         \t : %10.4f",
-           1000.0 * (double) (numMispred) / (double) (total_instruction_counter));
+           1000.0 * (double) (sim.numMispred) / (double) (total_instruction_counter));
+    printf("\n");
+    fflush(stdout);
+    // diagnostics go to stderr: stdout keeps the layout the result parsers expect
+    if (dtlb_misses->available()) {
+        fprintf(stderr, " (DTLB LOAD MISSES %llu) \n", (UINT64) dtlb_misses->value());
+    }
+    delete dtlb_misses;
+
+    return 0;
+}
+
+// Settings of the export modes, which write NumPy files instead of simulating
+struct ExportConfig {
+    bool features = false;      // --export-features
+    bool branches = false;      // --export-branches
+    unsigned ghist_bits = 64;   // --ghist-bits
+    unsigned path_length = 16;  // --path-length
+    unsigned lhist_bits = 16;   // --lhist-bits
+    size_t h2p_top = 0;         // --h2p-top: only the rows of the N most mispredicted PCs
+    uint64_t shard_rows = 0;    // --shard-rows: rows per .npy file (0: one file)
+
+    bool any() const {
+        return features || branches;
+    }
+};
+
+// Run the predictor over a trace and return the PCs of its top most mispredicted
+// conditional branches (the hard-to-predict branches, H2Ps); sets the share of all the
+// mispredictions they account for
+std::unordered_set<UINT64> RankH2P(const std::string &trace_path, PREDICTOR *brpred, CBPPlugin *plugin,
+                                   size_t top, double &share) {
+    std::unordered_map<UINT64, UINT64> mispredictions;
+    UINT64 total = 0;
+
+    bt9::BT9Reader bt9_reader(trace_path);
+    DecodeAhead decoder(bt9_reader);
+    const cbp_branch_record *recs;
+    size_t size, skipped;
+    cbp_branch_record batch[DECODE_AHEAD_CHUNK];
+    while (decoder.acquire(recs, size, skipped)) {
+        std::copy(recs, recs + size, batch);
+        decoder.release();
+        if (plugin) {
+            plugin->ProcessBatch(batch, size);
+        } else {
+            for (size_t i = 0; i < size; i++) {
+                brpred->PredictAndUpdate(batch[i]);
+            }
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (batch[i].conditional && batch[i].predDir != batch[i].branchTaken) {
+                mispredictions[batch[i].PC]++;
+                total++;
+            }
+        }
+    }
+
+    std::vector<std::pair<UINT64, UINT64> > ranked(mispredictions.begin(), mispredictions.end());
+    std::sort(ranked.begin(), ranked.end(), [](const std::pair<UINT64, UINT64> &a,
+                                               const std::pair<UINT64, UINT64> &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    ranked.resize(std::min(ranked.size(), top));
+
+    std::unordered_set<UINT64> h2ps;
+    UINT64 covered = 0;
+    for (const std::pair<UINT64, UINT64> &pc : ranked) {
+        h2ps.insert(pc.first);
+        covered += pc.second;
+    }
+    share = total ? (double) covered / (double) total : 0.0;
+    return h2ps;
+}
+
+// Write the history features of the conditional branches of a trace to
+// <trace>.features.npy (or its shards); the predictor only runs to rank the H2Ps
+int ExportFeatures(const std::string &trace_path, PREDICTOR *brpred, CBPPlugin *plugin, const ExportConfig &config) {
+    std::unordered_set<UINT64> h2ps;
+    double h2p_share = 0.0;
+    if (config.h2p_top > 0) {
+        h2ps = RankH2P(trace_path, brpred, plugin, config.h2p_top, h2p_share);
+    }
+
+    HistoryFeatures features(config.ghist_bits, config.path_length, config.lhist_bits);
+    size_t row_size = features.rowSize();
+    NpyWriter writer(trace_path + ".features", features.descr(), row_size, config.shard_rows);
+    std::vector<uint8_t> rows(DECODE_AHEAD_CHUNK * row_size);
+
+    bt9::BT9Reader bt9_reader(trace_path);
+    DecodeAhead decoder(bt9_reader);
+    const cbp_branch_record *recs;
+    size_t size, skipped;
+    bool ok = true;
+    while (ok && decoder.acquire(recs, size, skipped)) {
+        size_t n = 0;
+        for (size_t i = 0; i < size; i++) {
+            const cbp_branch_record &rec = recs[i];
+            bool emit = rec.conditional && (config.h2p_top == 0 || h2ps.count(rec.PC));
+            features.advance(rec, emit ? &rows[n++ * row_size] : NULL);
+        }
+        decoder.release();
+        ok = writer.write(rows.data(), n);
+    }
+    ok = writer.close() && ok;
+    if (!ok) {
+        fprintf(stderr, "Error occurred at writing time (%s)!\n", writer.path(writer.files() - 1).c_str());
+        return 1;
+    }
+
+    printf("  TRACE \t : %s", trace_path.c_str());
+    printf("  EXPORTED_BRANCHES           \t : %10llu", (unsigned long long) writer.rows());
+    if (config.h2p_top > 0) {
+        printf("  H2P_PCS                     \t : %10zu", h2ps.size());
+        printf("  H2P_MISPRED_SHARE           \t : %10.4f", h2p_share);
+    }
+    printf("  FILES                       \t : %10u", writer.files());
     printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+// Write the decoded branch stream of a trace, without simulating it, to one .npy file per
+// column: <trace>.branches.<column>.npy (or its shards). nonBrInstCnt is the number of
+// non-branch instructions executed after the branch, up to the next one.
+int ExportBranches(const std::string &trace_path, const ExportConfig &config) {
+    std::string prefix = trace_path + ".branches.";
+    NpyWriter pcs(prefix + "PC", "'<u8'", 8, config.shard_rows);
+    NpyWriter op_types(prefix + "opType", "'u1'", 1, config.shard_rows);
+    NpyWriter taken(prefix + "branchTaken", "'u1'", 1, config.shard_rows);
+    NpyWriter targets(prefix + "branchTarget", "'<u8'", 8, config.shard_rows);
+    NpyWriter inst_counts(prefix + "nonBrInstCnt", "'<u8'", 8, config.shard_rows);
+    NpyWriter *columns[] = {&pcs, &op_types, &taken, &targets, &inst_counts};
+
+    UINT64 pc_chunk[DECODE_AHEAD_CHUNK];
+    uint8_t op_type_chunk[DECODE_AHEAD_CHUNK];
+    uint8_t taken_chunk[DECODE_AHEAD_CHUNK];
+    UINT64 target_chunk[DECODE_AHEAD_CHUNK];
+    UINT64 inst_count_chunk[DECODE_AHEAD_CHUNK];
+    size_t n = 0;
+    auto flush = [&]() {
+        bool ok = pcs.write(pc_chunk, n) && op_types.write(op_type_chunk, n) && taken.write(taken_chunk, n) &&
+                  targets.write(target_chunk, n) && inst_counts.write(inst_count_chunk, n);
+        n = 0;
+        return ok;
+    };
+
+    // decoded inline: the instruction counts are not part of the pre-decoded records
+    bt9::BT9Reader bt9_reader(trace_path);
+    cbp_branch_record rec;
+    bool ok = true;
+    for (auto it = bt9_reader.begin(); ok && it != bt9_reader.end(); ++it) {
+        try {
+            if (!decodeBranchRecord(*it, rec)) {
+                continue;
+            }
+        }
+        catch (const std::out_of_range &ex) {
+            std::cout << ex.what() << '\n';
+            break;
+        }
+        pc_chunk[n] = rec.PC;
+        op_type_chunk[n] = (uint8_t) rec.opType;
+        taken_chunk[n] = rec.branchTaken;
+        target_chunk[n] = rec.branchTarget;
+        inst_count_chunk[n] = it->getEdge()->nonBrInstCnt();
+        if (++n == DECODE_AHEAD_CHUNK) {
+            ok = flush();
+        }
+    }
+    ok = flush() && ok;
+    for (NpyWriter *column : columns) {
+        if (!column->close() && ok) {
+            fprintf(stderr, "Error occurred at writing time (%s)!\n", column->path(column->files() - 1).c_str());
+            ok = false;
+        }
+    }
+    if (!ok) {
+        return 1;
+    }
+
+    printf("  TRACE \t : %s", trace_path.c_str());
+    printf("  EXPORTED_BRANCHES           \t : %10llu", (unsigned long long) pcs.rows());
+    printf("  FILES                       \t : %10u", 5 * pcs.files());
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+// Counts of one simulated region (or of the whole trace)
+struct RegionResult {
+    UINT64 branches = 0;
+    UINT64 instructions = 0;  // branches and the non-branch instructions after them
+    UINT64 mispredictions = 0;
+};
+
+// Simulate the regions of a trace, each after (up to) warmup branches that update the
+// predictor without being counted. A region whose warm-up would reach back into the
+// previous region continues from the predictor state of that region instead of starting
+// from a pristine predictor. Returns the number of branches simulated.
+UINT64 RunRegions(const std::string &trace_path, PREDICTOR *brpred, CBPPlugin *plugin,
+                  const std::vector<SimRegion> &regions, UINT64 warmup, std::vector<RegionResult> &results) {
+    results.assign(regions.size(), RegionResult());
+    bt9::BT9Reader bt9_reader(trace_path);
+    cbp_branch_record rec;
+    UINT64 index = 0;      // of the branch in the trace
+    UINT64 simulated = 0;
+    size_t r = 0;
+    // the first region starts from the pristine predictor the trace starts with
+    UINT64 warm_start = regions.empty() ? 0 : (regions[0].start > warmup ? regions[0].start - warmup : 0);
+    bool reset = false;    // at warm_start
+
+    for (auto it = bt9_reader.begin(); r < regions.size() && it != bt9_reader.end(); ++it) {
+        try {
+            if (!decodeBranchRecord(*it, rec)) {
+                continue;
+            }
+        }
+        catch (const std::out_of_range &ex) {
+            std::cout << ex.what() << '\n';
+            break;
+        }
+        const SimRegion &region = regions[r];
+        if (index >= warm_start) {
+            if (index == warm_start && reset) {
+                if (brpred) {
+                    brpred->reset();
+                } else {
+                    plugin->reset();
+                }
+            }
+            if (brpred) {
+                brpred->PredictAndUpdate(rec);
+            } else {
+                plugin->ProcessBatch(&rec, 1);
+            }
+            simulated++;
+            if (index >= region.start) {
+                RegionResult &result = results[r];
+                result.branches++;
+                result.instructions += 1 + it->getEdge()->nonBrInstCnt();
+                if (rec.conditional && rec.predDir != rec.branchTaken) {
+                    result.mispredictions++;
+                }
+                if (index + 1 == region.start + region.branches && ++r < regions.size()) {
+                    UINT64 start = regions[r].start;
+                    UINT64 warm = start > warmup ? start - warmup : 0;
+                    reset = warm > index + 1;
+                    warm_start = std::max(warm, index + 1);
+                }
+            }
+        }
+        index++;
+    }
+    return simulated;
+}
+
+// Estimate the MPKI of a trace from its regions; with validate, also simulate the whole
+// trace and report the error of the estimate
+int SimulateRegions(const std::string &trace_path, PREDICTOR *brpred, CBPPlugin *plugin,
+                    const std::vector<SimRegion> &regions, UINT64 warmup, bool validate) {
+    for (size_t r = 1; r < regions.size(); r++) {
+        if (regions[r].start < regions[r - 1].start + regions[r - 1].branches) {
+            fprintf(stderr, "Regions of %s overlap (at branch %llu)\n", trace_path.c_str(),
+                    (unsigned long long) regions[r].start);
+            return 1;
+        }
+    }
+
+    std::vector<RegionResult> results;
+    UINT64 simulated = RunRegions(trace_path, brpred, plugin, regions, warmup, results);
+    double weights = 0.0, estimate = 0.0;
+    for (size_t r = 0; r < regions.size(); r++) {
+        if (results[r].instructions > 0) {
+            weights += regions[r].weight;
+            estimate += regions[r].weight * 1000.0 * (double) results[r].mispredictions /
+                        (double) results[r].instructions;
+        }
+    }
+    estimate = weights > 0.0 ? estimate / weights : 0.0;
+
+    bt9::BT9Reader bt9_reader(trace_path);
+    std::string key = "total_instruction_count:";
+    std::string value;
+    bt9_reader.header.getFieldValueStr(key, value);
+    UINT64 total_instruction_counter = std::stoull(value, nullptr, 0);
+    key = "branch_instruction_count:";
+    bt9_reader.header.getFieldValueStr(key, value);
+    UINT64 branch_instruction_counter = std::stoull(value, nullptr, 0) - 1; // dummy branch at the beginning
+
+    printf("  TRACE \t : %s", trace_path.c_str());
+    printf("  NUM_REGIONS                 \t : %10zu", regions.size());
+    printf("  SIMULATED_BR                \t : %10llu", simulated);
+    printf("  SIMULATED_SHARE             \t : %10.4f", (double) simulated / (double) branch_instruction_counter);
+    printf("  EST_MISPRED_PER_1K_INST     \t : %10.4f", estimate);
+    if (validate) {
+        if (brpred) {
+            brpred->reset();
+        } else {
+            plugin->reset();
+        }
+        std::vector<SimRegion> whole(1, SimRegion{0, UINT64_MAX, 1.0});
+        RunRegions(trace_path, brpred, plugin, whole, 0, results);
+        double full = 1000.0 * (double) results[0].mispredictions / (double) total_instruction_counter;
+        printf("  MISPRED_PER_1K_INST         \t : %10.4f", full);
+        printf("  EST_ERROR                   \t : %10.4f", estimate - full);
+        printf("  EST_REL_ERROR               \t : %10.4f", full > 0.0 ? (estimate - full) / full : 0.0);
+    }
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+// Parse a non-negative integer option value no larger than max, false if it is not one
+bool ParseCount(const char *arg, unsigned long long max, unsigned long long &value) {
+    char *end;
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    return arg[0] != '-' && arg[0] != '\0' && *end == '\0' && errno == 0 && value <= max;
+}
+
+// usage: predictor [--plugin <libpredictor.so>] [--update-delay <branches>]
+//                  [--export-features [--ghist-bits <bits>] [--path-length <branches>] [--lhist-bits <bits>]
+//                   [--h2p-top <N>]] [--export-branches] [--shard-rows <rows>]
+//                  [--regions <file> [--warmup <branches>] [--validate]] <trace> [<trace> ...]
+
+int main(int argc, char *argv[]) {
+
+    std::vector<std::string> trace_paths;
+    std::string plugin_path;
+    int update_delay = 0;
+    ExportConfig export_config;
+    std::string regions_path;
+    UINT64 warmup = 1000000;
+    bool validate = false;
+    bool bad_args = false;
+    unsigned long long count;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--plugin") == 0 && i + 1 < argc) {
+            plugin_path = argv[++i];
+        } else if (strcmp(argv[i], "--update-delay") == 0 && i + 1 < argc) {
+            char *end;
+            long delay = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || delay < 0 || delay > (1 << 20)) {
+                bad_args = true;
+            }
+            update_delay = (int) delay;
+        } else if (strcmp(argv[i], "--export-features") == 0) {
+            export_config.features = true;
+        } else if (strcmp(argv[i], "--export-branches") == 0) {
+            export_config.branches = true;
+        } else if (strcmp(argv[i], "--ghist-bits") == 0 && i + 1 < argc) {
+            bad_args |= !ParseCount(argv[++i], FEATURE_MAX_GHIST_BITS, count) || count % 8 != 0;
+            export_config.ghist_bits = (unsigned) count;
+        } else if (strcmp(argv[i], "--path-length") == 0 && i + 1 < argc) {
+            bad_args |= !ParseCount(argv[++i], FEATURE_MAX_PATH_LENGTH, count);
+            export_config.path_length = (unsigned) count;
+        } else if (strcmp(argv[i], "--lhist-bits") == 0 && i + 1 < argc) {
+            bad_args |= !ParseCount(argv[++i], FEATURE_MAX_LHIST_BITS, count);
+            export_config.lhist_bits = (unsigned) count;
+        } else if (strcmp(argv[i], "--h2p-top") == 0 && i + 1 < argc) {
+            bad_args |= !ParseCount(argv[++i], SIZE_MAX, count);
+            export_config.h2p_top = (size_t) count;
+        } else if (strcmp(argv[i], "--shard-rows") == 0 && i + 1 < argc) {
+            bad_args |= !ParseCount(argv[++i], UINT64_MAX, count);
+            export_config.shard_rows = count;
+        } else if (strcmp(argv[i], "--regions") == 0 && i + 1 < argc) {
+            regions_path = argv[++i];
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            bad_args |= !ParseCount(argv[++i], UINT64_MAX, count);
+            warmup = count;
+        } else if (strcmp(argv[i], "--validate") == 0) {
+            validate = true;
+        } else if (argv[i][0] != '-') {
+            trace_paths.push_back(argv[i]);
+        } else {
+            bad_args = true;
+        }
+    }
+
+    if (trace_paths.empty() || bad_args) {
+        printf("usage: %s [--plugin <libpredictor.so>] [--update-delay <branches>]\n"
+               "       [--export-features [--ghist-bits <bits>] [--path-length <branches>] [--lhist-bits <bits>]\n"
+               "        [--h2p-top <N>]] [--export-branches] [--shard-rows <rows>]\n"
+               "       [--regions <file> [--warmup <branches>] [--validate]] <trace> [<trace> ...]\n",
+               argv[0]);
+        exit(-1);
+    }
+    if (export_config.any() && update_delay > 0) {
+        fprintf(stderr, "Fatal error: --update-delay does not apply to exports\n");
+        exit(-1);
+    }
+    std::map<std::string, std::vector<SimRegion> > regions;
+    if (!regions_path.empty()) {
+        if (export_config.any() || update_delay > 0) {
+            fprintf(stderr, "Fatal error: --regions does not combine with exports or --update-delay\n");
+            exit(-1);
+        }
+        if (!ReadRegions(regions_path, regions)) {
+            exit(-1);
+        }
+    }
+    // exports only run a predictor to rank the H2Ps
+    bool simulate = !export_config.any() || (export_config.features && export_config.h2p_top > 0);
+    if (update_delay > 0 && !plugin_path.empty()) {
+        fprintf(stderr, "Fatal error: --update-delay needs the built-in predictor (the plugin ABI updates "
+                        "right after each prediction)\n");
+        exit(-1);
+    }
+
+#ifdef SAVE_BINARY
+    if (!export_config.any() && regions_path.empty()) {
+        // before the predictor banner, as the stats of each trace follow the banner directly
+        BinDataPoint dp;
+        std::cout << "Size of BinDataPoint: " << sizeof(BinDataPoint) << std::endl;
+        std::cout << "    branchTaken:  " << sizeof(dp.branchTaken) << '(' << &dp.branchTaken << ')' << std::endl;
+        std::cout << "    predDir:      " << sizeof(dp.predDir) << '(' << &dp.predDir << ')' << std::endl;
+        std::cout << "    conditional:  " << sizeof(dp.conditional) << '(' << &dp.conditional << ')' << std::endl;
+        std::cout << "    opType:       " << sizeof(dp.opType) << '(' << &dp.opType << ')' << std::endl;
+        std::cout << "    branchTarget: " << sizeof(dp.branchTarget) << '(' << &dp.branchTarget << ')' << std::endl;
+        std::cout << "    PC:           " << sizeof(dp.PC) << '(' << &dp.PC << ')' << std::endl;
+    }
+#endif
+
+    PREDICTOR *brpred = nullptr;
+    CBPPlugin *plugin = nullptr;
+    if (simulate && plugin_path.empty()) {
+        brpred = new PREDICTOR();  // this instantiates the predictor code
+        fprintf(stderr, " (TABLES %s pages) ", USEARENA ? TARENA.mode() : "malloc");
+        if (update_delay > 0) {
+            fprintf(stderr, " (UPDATE DELAY %d branches) ", update_delay);
+        }
+    } else if (simulate) {
+        plugin = new CBPPlugin(plugin_path);  // this instantiates the predictor code of the plugin
+        UINT64 storage_bits = plugin->storageBits();
+        printf(" (PLUGIN %s) ", plugin->name());
+        if (storage_bits) {
+            printf(" (TOTAL %llu bits %llu Kbits) ", storage_bits, storage_bits / 1024);
+        }
+        fflush(stdout);
+    }
+
+    // allocated once: the delay queue is reused by every branch and every trace
+    std::vector<inflight_branch> inflight(update_delay + 1);
+
+    // every trace starts from a pristine predictor: the built-in one is restored from the
+    // image taken at construction, plugins are reset (or get a new instance)
+    int status = 0;
+    for (size_t t = 0; t < trace_paths.size(); t++) {
+        if (t > 0) {
+            if (brpred) {
+                brpred->reset();
+            } else if (plugin) {
+                plugin->reset();
+            }
+        }
+        if (export_config.features) {
+            status |= ExportFeatures(trace_paths[t], brpred, plugin, export_config);
+        }
+        if (export_config.branches) {
+            status |= ExportBranches(trace_paths[t], export_config);
+        }
+        if (!regions_path.empty()) {
+            auto trace_regions = regions.find(RegionTraceName(trace_paths[t]));
+            if (trace_regions == regions.end()) {
+                fprintf(stderr, "No regions for %s in %s\n", trace_paths[t].c_str(), regions_path.c_str());
+                status = 1;
+            } else {
+                status |= SimulateRegions(trace_paths[t], brpred, plugin, trace_regions->second, warmup, validate);
+            }
+        } else if (!export_config.any()) {
+            status |= SimulateTrace(trace_paths[t], brpred, plugin, update_delay, inflight.data());
+        }
+    }
+
+    delete plugin;
+    return status;
 }
@@ -0,0 +1,146 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    branch_batch.h
+ * \brief   BranchBatch: decoded branch records shared with Python without copying
+ *
+ * A BranchBatch owns an array of cbp_branch_record and exports it through the buffer
+ * protocol as a read-only 1-D array of structs with named fields, so that
+ * numpy.asarray(batch) is a structured array viewing the simulator's memory (field
+ * views such as a['PC'] do not copy either). Every array or memoryview created from a
+ * batch keeps it alive; the simulator only refills a batch nobody else references
+ * (BranchBatchIsShared), otherwise it starts a new one and the old records stay valid
+ * until Python releases them.
+ */
+
+#ifndef BRANCH_BATCH_H
+#define BRANCH_BATCH_H
+
+#include <Python.h>
+
+#include "cbp_plugin.h"
+
+static_assert(sizeof(cbp_branch_record) == 24, "BRANCH_RECORD_FORMAT assumes the 24-byte record");
+
+/// PEP 3118 description of cbp_branch_record (native alignment, no padding needed)
+#define BRANCH_RECORD_FORMAT "T{Q:PC:Q:branchTarget:I:opType:?:conditional:?:branchTaken:?:predDir:B:reserved:}"
+
+struct BranchBatchObject {
+    PyObject_HEAD
+    cbp_branch_record *recs;
+    Py_ssize_t size;        // valid records (what the buffer exports)
+    Py_ssize_t capacity;
+    Py_ssize_t itemsize;    // for the strides of exported buffers
+    Py_ssize_t exports;
+};
+
+static void BranchBatch_dealloc(PyObject *self) {
+    BranchBatchObject *batch = (BranchBatchObject *) self;
+    PyTypeObject *type = Py_TYPE(self);
+    delete[] batch->recs;
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static int BranchBatch_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+    BranchBatchObject *batch = (BranchBatchObject *) self;
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "BranchBatch is read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = self;
+    Py_INCREF(self);
+    view->buf = batch->recs;
+    view->len = batch->size * batch->itemsize;
+    view->readonly = 1;
+    view->itemsize = batch->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char *>(BRANCH_RECORD_FORMAT) : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &batch->size : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? &batch->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    batch->exports++;
+    return 0;
+}
+
+static void BranchBatch_releasebuffer(PyObject *self, Py_buffer *view) {
+    (void) view;
+    ((BranchBatchObject *) self)->exports--;
+}
+
+static Py_ssize_t BranchBatch_length(PyObject *self) {
+    return ((BranchBatchObject *) self)->size;
+}
+
+static char BranchBatchDoc[] = "Read-only batch of decoded branch records (buffer protocol)";
+
+static PyType_Slot BranchBatchSlots[] = {
+        {Py_tp_dealloc,        (void *) BranchBatch_dealloc},
+        {Py_bf_getbuffer,      (void *) BranchBatch_getbuffer},
+        {Py_bf_releasebuffer,  (void *) BranchBatch_releasebuffer},
+        {Py_sq_length,         (void *) BranchBatch_length},
+        {Py_tp_doc,            (void *) BranchBatchDoc},
+        {0,                    NULL}
+};
+
+static PyType_Spec BranchBatchSpec = {
+        "cbp16sim.BranchBatch", sizeof(BranchBatchObject), 0, Py_TPFLAGS_DEFAULT, BranchBatchSlots
+};
+
+/*!
+ * \brief The BranchBatch type of the current interpreter (created on first use)
+ *
+ * Sub-interpreters with their own GIL cannot share objects, so every interpreter keeps its
+ * own type in its interpreter dict. Returns a borrowed reference, NULL with a Python error
+ * set on failure.
+ */
+inline PyTypeObject *BranchBatchType() {
+    PyObject *dict = PyInterpreterState_GetDict(PyInterpreterState_Get());
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "no interpreter dict for the BranchBatch type");
+        return NULL;
+    }
+    PyObject *type = PyDict_GetItemString(dict, BranchBatchSpec.name);
+    if (type == NULL) {
+        type = PyType_FromSpec(&BranchBatchSpec);
+        if (type == NULL) {
+            return NULL;
+        }
+        int added = PyDict_SetItemString(dict, BranchBatchSpec.name, type);
+        Py_DECREF(type); // the interpreter dict keeps it alive
+        if (added < 0) {
+            return NULL;
+        }
+    }
+    return (PyTypeObject *) type;
+}
+
+/// New empty batch with room for capacity records, NULL with a Python error set on failure
+inline BranchBatchObject *NewBranchBatch(Py_ssize_t capacity) {
+    PyTypeObject *type = BranchBatchType();
+    if (type == NULL) {
+        return NULL;
+    }
+    BranchBatchObject *batch = PyObject_New(BranchBatchObject, type);
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->recs = new cbp_branch_record[capacity]();
+    batch->size = 0;
+    batch->capacity = capacity;
+    batch->itemsize = sizeof(cbp_branch_record);
+    batch->exports = 0;
+    return batch;
+}
+
+/// Whether Python still references the batch (then its records must not be overwritten)
+inline bool BranchBatchIsShared(BranchBatchObject *batch) {
+    return Py_REFCNT(batch) > 1 || batch->exports > 0;
+}
+
+// BRANCH_BATCH_H
+#endif
@@ -0,0 +1,147 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    call_profile.h
+ * \brief   Where the time of a simpython run goes (simpython --profile)
+ *
+ * Every PROFILE_SAMPLE_PERIOD-th branch has its Python calls timed with the TSC, split into
+ * marshalling (building the arguments, converting the result) and the call itself, i.e. the
+ * time spent in the interpreter running the predictor. Per-chunk work (waiting for decoded
+ * records, whole batches of the batch protocol, native callbacks) is timed every time. The
+ * totals of the per-branch phases are extrapolated from the samples and the call counts.
+ */
+
+#ifndef CALL_PROFILE_H
+#define CALL_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define PROFILE_SAMPLE_PERIOD 64
+
+/// Cycle counter for timing short intervals (nanoseconds where there is no TSC)
+inline uint64_t ReadTSC() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+enum CallPhase {
+    PHASE_GET_MARSHAL,
+    PHASE_GET_PYTHON,
+    PHASE_UPDATE_MARSHAL,
+    PHASE_UPDATE_PYTHON,
+    PHASE_TRACK_MARSHAL,
+    PHASE_TRACK_PYTHON,
+    PHASE_BATCH,
+    PHASE_NATIVE,
+    PHASE_DECODE,
+    NUM_CALL_PHASES
+};
+
+/*!
+ * \class CallProfile
+ * \brief Latency samples of one simulated trace, from construction to print()
+ */
+class CallProfile {
+    public:
+        CallProfile() : start_tsc_(ReadTSC()), start_time_(std::chrono::steady_clock::now()) {}
+
+        /// Whether the Python calls of the next branch are timed
+        bool sampleBranch() {
+            if (++countdown_ < PROFILE_SAMPLE_PERIOD) {
+                return false;
+            }
+            countdown_ = 0;
+            return true;
+        }
+
+        void record(CallPhase phase, uint64_t cycles) {
+            samples_[phase].push_back(cycles);
+        }
+
+        /// Number of times the phase ran (timed or not)
+        void setCalls(CallPhase phase, uint64_t calls) {
+            calls_[phase] = calls;
+        }
+
+        /// Counts phases timed on every occurrence
+        void addCall(CallPhase phase) {
+            calls_[phase]++;
+        }
+
+        /// Print the breakdown (estimated totals, share of the run, latency percentiles)
+        void print(FILE *out, const std::string &trace_path) {
+            double wall_ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_time_).count();
+            double ns_per_cycle = wall_ns / (double) std::max<uint64_t>(ReadTSC() - start_tsc_, 1);
+            static const char *names[NUM_CALL_PHASES] = {
+                    "GetPrediction marshal", "GetPrediction Python", "UpdatePredictor marshal",
+                    "UpdatePredictor Python", "TrackOtherInst marshal", "TrackOtherInst Python",
+                    "batch calls (per batch)", "native (per chunk)", "decode wait (per chunk)"};
+
+            std::string report;
+            char line[256];
+            snprintf(line, sizeof(line), "PROFILE %s (1 in %d branches timed, %.3f ns per tick)\n",
+                     trace_path.c_str(), PROFILE_SAMPLE_PERIOD, ns_per_cycle);
+            report += line;
+            snprintf(line, sizeof(line), "  %-24s %10s %10s %7s %9s %9s %9s %9s\n", "phase", "calls",
+                     "total ms", "share", "p50 ns", "p90 ns", "p99 ns", "max ns");
+            report += line;
+
+            double accounted_ns = 0.0;
+            for (int p = 0; p < NUM_CALL_PHASES; p++) {
+                std::vector<uint64_t> &samples = samples_[p];
+                if (calls_[p] == 0 || samples.empty()) {
+                    continue;
+                }
+                std::sort(samples.begin(), samples.end());
+                double sum = 0.0;
+                for (uint64_t cycles : samples) {
+                    sum += (double) cycles;
+                }
+                double total_ns = sum / (double) samples.size() * (double) calls_[p] * ns_per_cycle;
+                accounted_ns += total_ns;
+                snprintf(line, sizeof(line), "  %-24s %10llu %10.1f %6.1f%% %9.0f %9.0f %9.0f %9.0f\n", names[p],
+                         (unsigned long long) calls_[p], total_ns / 1e6, 100.0 * total_ns / wall_ns,
+                         percentile(samples, 0.50) * ns_per_cycle, percentile(samples, 0.90) * ns_per_cycle,
+                         percentile(samples, 0.99) * ns_per_cycle, (double) samples.back() * ns_per_cycle);
+                report += line;
+            }
+            double rest_ns = std::max(wall_ns - accounted_ns, 0.0);
+            snprintf(line, sizeof(line), "  %-24s %10s %10.1f %6.1f%%\n", "simulation loop, rest", "",
+                     rest_ns / 1e6, 100.0 * rest_ns / wall_ns);
+            report += line;
+            snprintf(line, sizeof(line), "  %-24s %10s %10.1f\n", "wall", "", wall_ns / 1e6);
+            report += line;
+            fputs(report.c_str(), out); // in one piece: workers of a pool share the stream
+            fflush(out);
+        }
+
+    private:
+        static double percentile(const std::vector<uint64_t> &sorted, double q) {
+            return (double) sorted[std::min(sorted.size() - 1, (size_t) (q * (double) sorted.size()))];
+        }
+
+        unsigned countdown_ = 0;
+        std::vector<uint64_t> samples_[NUM_CALL_PHASES];
+        uint64_t calls_[NUM_CALL_PHASES] = {};
+        uint64_t start_tsc_;
+        std::chrono::steady_clock::time_point start_time_;
+};
+
+// CALL_PROFILE_H
+#endif
@@ -45,6 +45,31 @@ class OpType:
     OPTYPE_MAX = 14
 
 
+# Fields of the branch records of the batch protocol, in memory order (24 bytes each)
+BRANCH_RECORD_FIELDS = ('PC', 'branchTarget', 'opType', 'conditional', 'branchTaken',
+                        'predDir', 'reserved')
+
+
+def is_conditional(opType):
+    """Whether opType is a conditional branch (works on ints and NumPy arrays)"""
+    return ((opType >= OpType.OPTYPE_RET_COND) &
+            (opType <= OpType.OPTYPE_CALL_INDIRECT_COND))
+
+
+def native_address(fn):
+    """Address of a compiled function for __cbp_native__: an int, a Numba cfunc, a ctypes
+    function (or pointer) or a cffi function pointer"""
+    if isinstance(fn, int):
+        return fn
+    if hasattr(fn, 'address'):  # numba.cfunc
+        return fn.address
+    if type(fn).__module__ == '_cffi_backend':
+        import cffi
+        return int(cffi.FFI().cast('uintptr_t', fn))
+    import ctypes
+    return ctypes.cast(fn, ctypes.c_void_p).value
+
+
 # noinspection PyPep8Naming
 class BASEPREDICTOR(ABC):
     """A dummy abstract predictor for testing with the CBP-16 simulator."""
@@ -81,3 +106,55 @@ class BASEPREDICTOR(ABC):
                        branchTarget: UINT64):
         """Subclasses can implement this to track unconditional branches"""
         pass
+
+    # Optional batch protocol. When BATCH_SIZE > 0 the simulator does not call the methods
+    # above but hands the predictor BATCH_SIZE branches at a time (the last batch can be
+    # shorter), conditional or not, in trace order: first GetPredictionBatch, then
+    # UpdateBatch with the outcomes. Predictions therefore cannot depend on the outcomes of
+    # earlier branches of the same batch. The arguments are read-only NumPy views of the
+    # decoded branch records (no copies); the simulator does not reuse records that are
+    # still referenced, so arrays can be kept (e.g. to accumulate training data) as is.
+    BATCH_SIZE = 0
+
+    def GetPredictionBatch(self,
+                           PC,
+                           opType,
+                           branchTarget):
+        """Returns one prediction per branch (bool array-like, ignored for unconditional
+        branches). PC and branchTarget are uint64 arrays, opType uint32."""
+        return [bool(self.GetPrediction(int(pc))) if conditional else False
+                for pc, conditional in zip(PC, is_conditional(opType))]
+
+    def UpdateBatch(self,
+                    PC,
+                    opType,
+                    resolveDir,
+                    predDir,
+                    branchTarget):
+        """resolveDir and predDir are bool arrays, the others as in GetPredictionBatch"""
+        for pc, op, taken, pred, target in zip(PC.tolist(), opType.tolist(),
+                                               resolveDir.tolist(), predDir.tolist(),
+                                               branchTarget.tolist()):
+            if is_conditional(op):
+                self.UpdatePredictor(pc, op, taken, pred, target)
+            else:
+                self.TrackOtherInst(pc, op, taken, target)
+
+    def ObserveBatch(self,
+                     records):
+        """Called after UpdateBatch with the whole batch as a read-only NumPy structured
+        array (BRANCH_RECORD_FIELDS, predDir filled in), for vectorized feature
+        extraction over the trace"""
+        pass
+
+    # Optional native fast path. A dict of native_address()es of compiled functions with the
+    # signatures of cbp_plugin_api in cbp_plugin.h (or a method returning one):
+    #     int get_prediction(void *state, uint64_t PC)
+    #     void update(void *state, uint64_t PC, uint32_t opType, int resolveDir, int predDir,
+    #                 uint64_t branchTarget)
+    #     void track_other(void *state, uint64_t PC, uint32_t opType, int taken,
+    #                      uint64_t branchTarget)                           (optional)
+    #     void process_batch(void *state, cbp_branch_record *recs, size_t n)  (optional)
+    # plus an optional 'state' address passed as the first argument. When it is set, the
+    # simulator calls them directly for every branch and none of the methods above.
+    __cbp_native__ = None
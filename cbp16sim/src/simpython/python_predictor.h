@@ -0,0 +1,534 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    python_predictor.h
+ * \brief   Driving a Python BASEPREDICTOR, branch by branch or through its batch protocol
+ *
+ * Shared by simpython (embedded interpreter) and the cbp16sim extension module. The
+ * functions leave a Python exception set when they fail; reporting it is up to the caller.
+ */
+
+#ifndef PYTHON_PREDICTOR_H
+#define PYTHON_PREDICTOR_H
+
+#include <Python.h>
+
+#include "utils.h"
+#include "branch_batch.h"
+#include "call_profile.h"
+
+// Python ints for 64-bit values that keep coming back (branch PCs and targets): a
+// direct-mapped cache, so that most calls pass an existing object instead of a new one
+#define PYLONG_CACHE_LOG 12
+
+struct PyLongCache {
+    UINT64 keys[1 << PYLONG_CACHE_LOG];
+    PyObject *values[1 << PYLONG_CACHE_LOG] = {};
+
+    /// New reference to int(value), NULL on error
+    PyObject *get(UINT64 value) {
+        size_t slot = (value ^ (value >> PYLONG_CACHE_LOG) ^ (value >> (2 * PYLONG_CACHE_LOG))) &
+                      ((1 << PYLONG_CACHE_LOG) - 1);
+        if (values[slot] == NULL || keys[slot] != value) {
+            PyObject *obj = PyLong_FromUnsignedLongLong(value);
+            if (obj == NULL) {
+                return NULL;
+            }
+            Py_XDECREF(values[slot]);
+            values[slot] = obj;
+            keys[slot] = value;
+        }
+        Py_INCREF(values[slot]);
+        return values[slot];
+    }
+
+    void clear() {
+        for (size_t slot = 0; slot < (1 << PYLONG_CACHE_LOG); slot++) {
+            Py_CLEAR(values[slot]);
+        }
+    }
+};
+
+/*!
+ * \brief Whether brpred overrides the BASEPREDICTOR method name
+ *
+ * The no-op hooks of BASEPREDICTOR are not worth a call into the interpreter per branch.
+ * Predictors that do not derive from BASEPREDICTOR are taken to override everything.
+ * \return 1 or 0, -1 on error
+ */
+inline int PythonOverrides(PyObject *brpred, const char *name) {
+    PyObject *mro = Py_TYPE(brpred)->tp_mro;
+    PyObject *base_func = NULL;
+    for (Py_ssize_t i = 0; mro != NULL && i < PyTuple_GET_SIZE(mro); i++) {
+        PyTypeObject *cls = (PyTypeObject *) PyTuple_GET_ITEM(mro, i);
+        if (strcmp(cls->tp_name, "BASEPREDICTOR") == 0) {
+            base_func = PyDict_GetItemString(cls->tp_dict, name);
+            break;
+        }
+    }
+    if (base_func == NULL) {
+        return 1;
+    }
+
+    PyObject *bound = PyObject_GetAttrString(brpred, name);
+    if (bound == NULL) {
+        return -1;
+    }
+    PyObject *func = PyObject_GetAttrString(bound, "__func__");
+    Py_DECREF(bound);
+    if (func == NULL) {
+        PyErr_Clear();  // not a plain method: something else was put in its place
+        return 1;
+    }
+    int overrides = func != base_func;
+    Py_DECREF(func);
+    return overrides;
+}
+
+// Per-branch protocol: GetPrediction, UpdatePredictor and TrackOtherInst are called through
+// vectorcall with argument arrays on the stack, and the arguments are cached objects
+// (interned ints for PCs/targets and opTypes, the bool singletons for directions)
+struct PythonCalls {
+    PyObject *getPrediction = NULL;
+    PyObject *updatePredictor = NULL;
+    PyObject *trackOtherInst = NULL;
+    bool updatePredictorActive = true;  // false: the BASEPREDICTOR no-op, never called
+    bool trackOtherInstActive = true;
+    PyObject *opTypes[OPTYPE_MAX + 1] = {};
+    PyLongCache addresses;
+    CallProfile *profile = NULL;  // set with timed = true to time the calls of a branch
+    bool timed = false;
+};
+
+// Records the marshalling (t0..t1 and t2..now) and call (t1..t2) times of a timed call
+inline void ProfilePythonCall(PythonCalls &calls, CallPhase marshal, uint64_t t0, uint64_t t1, uint64_t t2) {
+    calls.profile->record(marshal, (t1 - t0) + (ReadTSC() - t2));
+    calls.profile->record((CallPhase) (marshal + 1), t2 - t1);
+}
+
+/*!
+ * \brief Looks up the per-branch methods of brpred
+ * \param failed set to the name of the method that is missing, if any
+ */
+inline bool InitPythonCalls(PythonCalls &calls, PyObject *brpred, const char **failed) {
+    const char *names[3] = {"GetPrediction", "UpdatePredictor", "TrackOtherInst"};
+    PyObject **methods[3] = {&calls.getPrediction, &calls.updatePredictor, &calls.trackOtherInst};
+    for (int m = 0; m < 3; m++) {
+        *methods[m] = PyObject_GetAttrString(brpred, names[m]);
+        if (*methods[m] == NULL || !PyCallable_Check(*methods[m])) {
+            if (!PyErr_Occurred())
+                PyErr_Format(PyExc_TypeError, "PREDICTOR.%s is not callable", names[m]);
+            *failed = names[m];
+            return false;
+        }
+    }
+    int update = PythonOverrides(brpred, "UpdatePredictor");
+    int track = PythonOverrides(brpred, "TrackOtherInst");
+    if (update < 0 || track < 0) {
+        *failed = update < 0 ? "UpdatePredictor" : "TrackOtherInst";
+        return false;
+    }
+    calls.updatePredictorActive = update;
+    calls.trackOtherInstActive = track;
+    for (int op = 0; op <= OPTYPE_MAX; op++) {
+        calls.opTypes[op] = PyLong_FromLong(op);
+        if (calls.opTypes[op] == NULL) {
+            *failed = "GetPrediction";
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void FreePythonCalls(PythonCalls &calls) {
+    Py_CLEAR(calls.getPrediction);
+    Py_CLEAR(calls.updatePredictor);
+    Py_CLEAR(calls.trackOtherInst);
+    for (int op = 0; op <= OPTYPE_MAX; op++) {
+        Py_CLEAR(calls.opTypes[op]);
+    }
+    calls.addresses.clear();
+}
+
+inline PyObject *PythonOpType(PythonCalls &calls, uint32_t opType) {
+    return calls.opTypes[opType <= OPTYPE_MAX ? opType : (uint32_t) OPTYPE_ERROR];
+}
+
+/// GetPrediction(PC) as 0/1, -1 on error
+inline int PythonGetPrediction(PythonCalls &calls, UINT64 PC) {
+    uint64_t t0 = calls.timed ? ReadTSC() : 0;
+    // slot 0 is scratch space for the bound method (PY_VECTORCALL_ARGUMENTS_OFFSET)
+    PyObject *args[2] = {NULL, calls.addresses.get(PC)};
+    if (args[1] == NULL) {
+        return -1;
+    }
+    uint64_t t1 = calls.timed ? ReadTSC() : 0;
+    PyObject *result = PyObject_Vectorcall(calls.getPrediction, args + 1, 1 | PY_VECTORCALL_ARGUMENTS_OFFSET,
+                                           NULL);
+    uint64_t t2 = calls.timed ? ReadTSC() : 0;
+    Py_DECREF(args[1]);
+    if (result == NULL) {
+        return -1;
+    }
+    int truth = PyObject_IsTrue(result);
+    Py_DECREF(result);
+    if (calls.timed) {
+        ProfilePythonCall(calls, PHASE_GET_MARSHAL, t0, t1, t2);
+    }
+    return truth;
+}
+
+/// UpdatePredictor(PC, opType, resolveDir, predDir, branchTarget)
+inline bool PythonUpdatePredictor(PythonCalls &calls, const cbp_branch_record &rec) {
+    if (!calls.updatePredictorActive) {
+        return true;
+    }
+    uint64_t t0 = calls.timed ? ReadTSC() : 0;
+    PyObject *pc = calls.addresses.get(rec.PC);
+    PyObject *target = calls.addresses.get(rec.branchTarget);
+    PyObject *result = NULL;
+    uint64_t t1 = 0, t2 = 0;
+    if (pc != NULL && target != NULL) {
+        PyObject *args[6] = {NULL, pc, PythonOpType(calls, rec.opType), rec.branchTaken ? Py_True : Py_False,
+                             rec.predDir ? Py_True : Py_False, target};
+        t1 = calls.timed ? ReadTSC() : 0;
+        result = PyObject_Vectorcall(calls.updatePredictor, args + 1, 5 | PY_VECTORCALL_ARGUMENTS_OFFSET, NULL);
+        t2 = calls.timed ? ReadTSC() : 0;
+    }
+    Py_XDECREF(pc);
+    Py_XDECREF(target);
+    Py_XDECREF(result);
+    if (calls.timed && result != NULL) {
+        ProfilePythonCall(calls, PHASE_UPDATE_MARSHAL, t0, t1, t2);
+    }
+    return result != NULL;
+}
+
+/// TrackOtherInst(PC, opType, taken, branchTarget)
+inline bool PythonTrackOtherInst(PythonCalls &calls, const cbp_branch_record &rec) {
+    if (!calls.trackOtherInstActive) {
+        return true;
+    }
+    uint64_t t0 = calls.timed ? ReadTSC() : 0;
+    PyObject *pc = calls.addresses.get(rec.PC);
+    PyObject *target = calls.addresses.get(rec.branchTarget);
+    PyObject *result = NULL;
+    uint64_t t1 = 0, t2 = 0;
+    if (pc != NULL && target != NULL) {
+        PyObject *args[5] = {NULL, pc, PythonOpType(calls, rec.opType), rec.branchTaken ? Py_True : Py_False,
+                             target};
+        t1 = calls.timed ? ReadTSC() : 0;
+        result = PyObject_Vectorcall(calls.trackOtherInst, args + 1, 4 | PY_VECTORCALL_ARGUMENTS_OFFSET, NULL);
+        t2 = calls.timed ? ReadTSC() : 0;
+    }
+    Py_XDECREF(pc);
+    Py_XDECREF(target);
+    Py_XDECREF(result);
+    if (calls.timed && result != NULL) {
+        ProfilePythonCall(calls, PHASE_TRACK_MARSHAL, t0, t1, t2);
+    }
+    return result != NULL;
+}
+
+// Branches buffered for the batch protocol of BASEPREDICTOR (BATCH_SIZE > 0). They are
+// decoded straight into a BranchBatch, which the predictor sees as NumPy views.
+struct PythonBatch {
+    size_t capacity = 0;
+    size_t size = 0;
+    BranchBatchObject *records = NULL;
+    PyObject *asarray = NULL;  // numpy.asarray
+    PyObject *fields[5] = {NULL, NULL, NULL, NULL, NULL};  // PC, opType, branchTaken, predDir, branchTarget
+    PyObject *getPredictionBatch = NULL;
+    PyObject *updateBatch = NULL;
+    PyObject *observeBatch = NULL;
+    bool updateBatchActive = true;  // false: would only end up in BASEPREDICTOR no-ops
+    bool observeBatchActive = true;
+};
+
+/// The BATCH_SIZE of a predictor (0 when it does not define one), -1 on error
+inline long PythonBatchSize(PyObject *brpred) {
+    PyObject *attr = PyObject_GetAttrString(brpred, "BATCH_SIZE");
+    if (attr == NULL) {
+        PyErr_Clear();  // not derived from BASEPREDICTOR: per-branch calls
+        return 0;
+    }
+    long size = PyLong_AsLong(attr);
+    Py_DECREF(attr);
+    if (size < 0 || PyErr_Occurred()) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "PREDICTOR BATCH_SIZE must be a non-negative integer");
+        return -1;
+    }
+    return size;
+}
+
+inline bool InitPythonBatch(PythonBatch &batch, PyObject *brpred, size_t capacity) {
+    batch.capacity = capacity;
+    batch.records = NewBranchBatch((Py_ssize_t) capacity);
+    if (batch.records == NULL) {
+        return false;
+    }
+
+    PyObject *numpy = PyImport_ImportModule("numpy");
+    if (numpy == NULL) {
+        return false;
+    }
+    batch.asarray = PyObject_GetAttrString(numpy, "asarray");
+    Py_DECREF(numpy);
+    if (batch.asarray == NULL) {
+        return false;
+    }
+    const char *names[5] = {"PC", "opType", "branchTaken", "predDir", "branchTarget"};
+    for (int f = 0; f < 5; f++) {
+        batch.fields[f] = PyUnicode_InternFromString(names[f]);
+        if (batch.fields[f] == NULL) {
+            return false;
+        }
+    }
+
+    batch.getPredictionBatch = PyObject_GetAttrString(brpred, "GetPredictionBatch");
+    batch.updateBatch = PyObject_GetAttrString(brpred, "UpdateBatch");
+    batch.observeBatch = PyObject_GetAttrString(brpred, "ObserveBatch");
+    if (batch.getPredictionBatch == NULL || !PyCallable_Check(batch.getPredictionBatch) ||
+        batch.updateBatch == NULL || !PyCallable_Check(batch.updateBatch) ||
+        batch.observeBatch == NULL || !PyCallable_Check(batch.observeBatch)) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_TypeError,
+                        "the batch protocol needs the GetPredictionBatch, UpdateBatch and ObserveBatch methods");
+        return false;
+    }
+
+    // the default UpdateBatch only forwards to UpdatePredictor and TrackOtherInst
+    int update = PythonOverrides(brpred, "UpdateBatch");
+    int update_predictor = PythonOverrides(brpred, "UpdatePredictor");
+    int track = PythonOverrides(brpred, "TrackOtherInst");
+    int observe = PythonOverrides(brpred, "ObserveBatch");
+    if (update < 0 || update_predictor < 0 || track < 0 || observe < 0) {
+        return false;
+    }
+    batch.updateBatchActive = update || update_predictor || track;
+    batch.observeBatchActive = observe;
+    return true;
+}
+
+inline void FreePythonBatch(PythonBatch &batch) {
+    Py_XDECREF(batch.records);
+    Py_XDECREF(batch.asarray);
+    for (int f = 0; f < 5; f++) {
+        Py_XDECREF(batch.fields[f]);
+    }
+    Py_XDECREF(batch.getPredictionBatch);
+    Py_XDECREF(batch.updateBatch);
+    Py_XDECREF(batch.observeBatch);
+    batch = PythonBatch();
+}
+
+// Copies the predictions returned by GetPredictionBatch into the predDir of the records
+inline bool ReadPredictions(PythonBatch &batch, PyObject *predictions) {
+    cbp_branch_record *recs = batch.records->recs;
+    Py_buffer view;
+    if (PyObject_GetBuffer(predictions, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0) {
+        // NumPy bool/int8/uint8 arrays: one byte per prediction
+        bool ok = view.itemsize == 1 && view.len == (Py_ssize_t) batch.size;
+        if (ok) {
+            const uint8_t *p = (const uint8_t *) view.buf;
+            for (size_t i = 0; i < batch.size; i++) {
+                recs[i].predDir = p[i] != 0;
+            }
+        }
+        PyBuffer_Release(&view);
+        if (ok) {
+            return true;
+        }
+    } else {
+        PyErr_Clear();
+    }
+
+    PyObject *seq = PySequence_Fast(predictions, "GetPredictionBatch must return a sequence");
+    if (seq == NULL) {
+        return false;
+    }
+    bool ok = PySequence_Fast_GET_SIZE(seq) == (Py_ssize_t) batch.size;
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "GetPredictionBatch must return one prediction per branch");
+    }
+    for (size_t i = 0; ok && i < batch.size; i++) {
+        int truth = PyObject_IsTrue(PySequence_Fast_GET_ITEM(seq, i));
+        ok = truth >= 0;
+        recs[i].predDir = truth > 0;
+    }
+    Py_DECREF(seq);
+    return ok;
+}
+
+/*!
+ * \brief Runs the batch protocol on the buffered branches, filling in their predDir
+ * \param failed set to the name of the method that failed, if any
+ */
+inline bool RunPythonBatch(PythonBatch &batch, const char **failed) {
+    batch.records->size = (Py_ssize_t) batch.size;
+    PyObject *array = PyObject_CallFunctionObjArgs(batch.asarray, (PyObject *) batch.records, NULL);
+    PyObject *args[5] = {NULL, NULL, NULL, NULL, NULL};
+    bool ok = array != NULL;
+    for (int f = 0; ok && f < 5; f++) {
+        args[f] = PyObject_GetItem(array, batch.fields[f]);
+        ok = args[f] != NULL;
+    }
+    if (!ok) {
+        *failed = "GetPredictionBatch";
+    }
+
+    if (ok) {
+        PyObject *predictions = PyObject_CallFunctionObjArgs(batch.getPredictionBatch, args[0], args[1], args[4],
+                                                             NULL);
+        ok = predictions != NULL && ReadPredictions(batch, predictions);
+        Py_XDECREF(predictions);
+        if (!ok) {
+            *failed = "GetPredictionBatch";
+        }
+    }
+    if (ok && batch.updateBatchActive) {
+        PyObject *result = PyObject_CallFunctionObjArgs(batch.updateBatch, args[0], args[1], args[2], args[3],
+                                                        args[4], NULL);
+        ok = result != NULL;
+        Py_XDECREF(result);
+        if (!ok) {
+            *failed = "UpdateBatch";
+        }
+    }
+    if (ok && batch.observeBatchActive) {
+        PyObject *result = PyObject_CallFunctionObjArgs(batch.observeBatch, array, NULL);
+        ok = result != NULL;
+        Py_XDECREF(result);
+        if (!ok) {
+            *failed = "ObserveBatch";
+        }
+    }
+    for (int f = 0; f < 5; f++) {
+        Py_XDECREF(args[f]);
+    }
+    Py_XDECREF(array);
+    return ok;
+}
+
+/// Makes room for the next batch; records still referenced from Python stay as they are
+inline bool RecyclePythonBatch(PythonBatch &batch) {
+    batch.size = 0;
+    if (BranchBatchIsShared(batch.records)) {
+        Py_DECREF(batch.records);
+        batch.records = NewBranchBatch((Py_ssize_t) batch.capacity);
+        if (batch.records == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Native fast path: a PREDICTOR whose predict and update are compiled code (Numba cfunc,
+// Cython, ctypes, cffi, ...) can expose their addresses through a __cbp_native__ dict
+// (or a method returning one) with the signatures of the cbp_plugin_api entry points:
+//     "get_prediction", "update"          required
+//     "track_other", "process_batch"      optional
+//     "state"                             optional, the pred argument of every call
+// Each value is an int address (predictor.native_address converts the usual function
+// objects). The simulator then never calls into the interpreter for branches.
+
+struct PythonNative {
+    PyObject *owner = NULL;  // the dict, which keeps ctypes/cffi function objects alive
+    void *state = NULL;
+    int (*get_prediction)(void *pred, uint64_t PC) = NULL;
+    void (*update)(void *pred, uint64_t PC, uint32_t opType, int resolveDir, int predDir,
+                   uint64_t branchTarget) = NULL;
+    void (*track_other)(void *pred, uint64_t PC, uint32_t opType, int taken, uint64_t branchTarget) = NULL;
+    void (*process_batch)(void *pred, cbp_branch_record *recs, size_t n) = NULL;
+};
+
+/// Address stored under key in the __cbp_native__ dict (NULL if absent), false on error
+inline bool NativeAddress(PyObject *dict, const char *key, void **address) {
+    PyObject *value = PyDict_GetItemString(dict, key);
+    *address = NULL;
+    if (value == NULL || value == Py_None) {
+        return true;
+    }
+    PyObject *index = PyNumber_Index(value);
+    if (index == NULL) {
+        PyErr_Format(PyExc_TypeError, "__cbp_native__['%s'] must be an int address "
+                                      "(see predictor.native_address)", key);
+        return false;
+    }
+    *address = PyLong_AsVoidPtr(index);
+    Py_DECREF(index);
+    return !PyErr_Occurred();
+}
+
+/// Read brpred.__cbp_native__: 1 if the predictor has native callbacks, 0 if not, -1 on error
+inline int InitPythonNative(PythonNative &native, PyObject *brpred) {
+    PyObject *attr = PyObject_GetAttrString(brpred, "__cbp_native__");
+    if (attr == NULL) {
+        PyErr_Clear();  // not derived from BASEPREDICTOR
+        return 0;
+    }
+    if (attr != Py_None && PyCallable_Check(attr)) {
+        Py_SETREF(attr, PyObject_CallNoArgs(attr));
+        if (attr == NULL) {
+            return -1;
+        }
+    }
+    if (attr == Py_None) {
+        Py_DECREF(attr);
+        return 0;
+    }
+    if (!PyDict_Check(attr)) {
+        PyErr_SetString(PyExc_TypeError, "PREDICTOR __cbp_native__ must be a dict of addresses");
+        Py_DECREF(attr);
+        return -1;
+    }
+    native.owner = attr;
+
+    void *get_prediction, *update, *track_other, *process_batch;
+    if (!NativeAddress(attr, "state", &native.state) ||
+        !NativeAddress(attr, "get_prediction", &get_prediction) ||
+        !NativeAddress(attr, "update", &update) ||
+        !NativeAddress(attr, "track_other", &track_other) ||
+        !NativeAddress(attr, "process_batch", &process_batch)) {
+        return -1;
+    }
+    if (get_prediction == NULL || update == NULL) {
+        PyErr_SetString(PyExc_ValueError, "PREDICTOR __cbp_native__ needs 'get_prediction' and 'update'");
+        return -1;
+    }
+    native.get_prediction = (decltype(native.get_prediction)) get_prediction;
+    native.update = (decltype(native.update)) update;
+    native.track_other = (decltype(native.track_other)) track_other;
+    native.process_batch = (decltype(native.process_batch)) process_batch;
+    return 1;
+}
+
+inline void FreePythonNative(PythonNative &native) {
+    Py_CLEAR(native.owner);
+}
+
+/*!
+ * \brief Predict and update n records in trace order through the native callbacks
+ * \note Does not need the GIL (callbacks that do, like ctypes ones, take it themselves)
+ */
+inline void RunPythonNative(const PythonNative &native, cbp_branch_record *recs, size_t n) {
+    if (native.process_batch != NULL) {
+        native.process_batch(native.state, recs, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        cbp_branch_record &rec = recs[i];
+        if (rec.conditional) {
+            rec.predDir = native.get_prediction(native.state, rec.PC) != 0;
+            native.update(native.state, rec.PC, rec.opType, rec.branchTaken, rec.predDir, rec.branchTarget);
+        } else if (native.track_other != NULL) {
+            native.track_other(native.state, rec.PC, rec.opType, rec.branchTaken, rec.branchTarget);
+        }
+    }
+}
+
+// PYTHON_PREDICTOR_H
+#endif
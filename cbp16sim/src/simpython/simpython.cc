@@ -15,19 +15,61 @@
 #include <Python.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <new>
+#include <thread>
+#include <vector>
 using namespace std;
 
 #include "utils.h"
 #include "bt9_reader.h"
+#include "decode_ahead.h"
+#include "python_predictor.h"
 
 
 #define COUNTER     unsigned long long
 
+// states of a trace in the --jobs queue
+#define TRACE_PENDING 0
+#define TRACE_RUNNING 1
+#define TRACE_DONE    2
+#define TRACE_FAILED  3
+
+// pool workers collect the progress report of their trace (MPKBr_*) in its result, which
+// the parent prints with the rest of the statistics: the reports of concurrent traces
+// would interleave on stdout
+#define HEARTBEAT_LOG_SIZE 640
+thread_local char *HeartBeatLog = NULL;
+
+// --profile: report where the time of each trace goes (on stderr)
+bool Profile = false;
+
+// --threads: sub-interpreters with their own GIL appeared in 3.12 (free-threaded builds are 3.13+)
+#if PY_VERSION_HEX >= 0x030C0000
+#define SIMPYTHON_THREADS
+#endif
+
+void PrintHeartBeat(const char *format, double mpki) {
+    if (HeartBeatLog == NULL) {
+        printf(format, mpki);
+        fflush(stdout);
+        return;
+    }
+    size_t used = strlen(HeartBeatLog);
+    snprintf(HeartBeatLog + used, HEARTBEAT_LOG_SIZE - used, format, mpki);
+}
 
 void CheckHeartBeat(UINT64 numIter, UINT64 numMispred) {
+
     UINT64 d1K = 1000;
     UINT64 d10K = 10000;
     UINT64 d100K = 100000;
@@ -42,62 +84,50 @@ void CheckHeartBeat(UINT64 numIter, UINT64 numMispred) {
     UINT64 d10B = 10000000000;
 
     if (numIter == d1K) { //prints MPKI after 100K branches
-        printf("  MPKBr_1K         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_1K         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d10K) { //prints MPKI after 100K branches
-        printf("  MPKBr_10K         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_10K         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d100K) { //prints MPKI after 100K branches
-        printf("  MPKBr_100K         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_100K         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
     if (numIter == d1M) {
-        printf("  MPKBr_1M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_1M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d10M) { //prints MPKI after 100K branches
-        printf("  MPKBr_10M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_10M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d30M) { //prints MPKI after 100K branches
-        printf("  MPKBr_30M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_30M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d60M) { //prints MPKI after 100K branches
-        printf("  MPKBr_60M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_60M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d100M) { //prints MPKI after 100K branches
-        printf("  MPKBr_100M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_100M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d300M) { //prints MPKI after 100K branches
-        printf("  MPKBr_300M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_300M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d600M) { //prints MPKI after 100K branches
-        printf("  MPKBr_600M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_600M         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d1B) { //prints MPKI after 100K branches
-        printf("  MPKBr_1B         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_1B         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
     if (numIter == d10B) { //prints MPKI after 100K branches
-        printf("  MPKBr_10B         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
-        fflush(stdout);
+        PrintHeartBeat("  MPKBr_10B         \t : %10.4f", 1000.0 * (double) (numMispred) / (double) (numIter));
     }
 
 }//void CheckHeartBeat
@@ -111,29 +141,73 @@ inline void pythonCleanup(wchar_t *program) {
     PyMem_RawFree(program); // free up Python memory
 }
 
-int main(int argc, char *argv[]) {
-    char *predictor_name = "dummy_predictor";
-    if (argc == 3) {
-        predictor_name = argv[2];
-        // Check if .py, remove this to get module name
-        int len = strlen(predictor_name);
-        if (len > 3 && strcmp(&predictor_name[len - 3], ".py") == 0)
-            predictor_name[len - 3] = '\0';
-    } else if (argc != 2) {
-        printf("usage: %s <trace> [<predictor_module>]\n", argv[0]);
-        exit(-1);
+// Records one occurrence of a phase that is timed every time (profile may be NULL)
+inline void ProfilePhase(CallProfile *profile, CallPhase phase, uint64_t start) {
+    if (profile != NULL) {
+        profile->record(phase, ReadTSC() - start);
+        profile->addCall(phase);
     }
+}
 
-    PyObject *brpred;
-    // PREDICTOR *brpred = new PREDICTOR();  // this instantiates the predictor code
-    // Python init
-    wchar_t *program = Py_DecodeLocale(argv[0], NULL);
-    if (program == NULL) {
-        fprintf(stderr, "Fatal error: cannot decode argv[0]\n");
-        exit(1);
+// Runs the buffered branches through the predictor and accounts for them in trace order
+bool FlushPythonBatch(PythonBatch &batch, UINT64 &numIter, UINT64 &numMispred, CallProfile *profile) {
+    if (batch.size == 0) {
+        return true;
     }
-    Py_SetProgramName(program);
-    Py_Initialize();
+
+    const char *failed = NULL;
+    uint64_t start = profile ? ReadTSC() : 0;
+    bool ran = RunPythonBatch(batch, &failed);
+    ProfilePhase(profile, PHASE_BATCH, start);
+    if (!ran) {
+        PyErr_Print();
+        fprintf(stderr, "Fatal error: did not call PREDICTOR %s successfully.", failed);
+        return false;
+    }
+
+    const cbp_branch_record *recs = batch.records->recs;
+    for (size_t i = 0; i < batch.size; i++) {
+        CheckHeartBeat(++numIter, numMispred);
+        if (recs[i].conditional && recs[i].predDir != recs[i].branchTaken) {
+            numMispred++;
+        }
+    }
+
+    if (!RecyclePythonBatch(batch)) {
+        PyErr_Print();
+        return false;
+    }
+    return true;
+}
+
+// Statistics of one simulated trace (in --jobs mode they live in memory shared with the parent)
+struct TraceResult {
+    int state = TRACE_PENDING;
+    UINT64 instructions = 0;
+    UINT64 branches = 0;
+    UINT64 uncond = 0;
+    UINT64 cond = 0;
+    UINT64 mispred = 0;
+    char heartbeats[HEARTBEAT_LOG_SIZE] = {};  // MPKBr_* of a pooled trace, in stdout format
+};
+
+void PrintTraceStats(const std::string &trace_path, const TraceResult &result) {
+    //NOTE: competitors are judged solely on MISPRED_PER_1K_INST. The additional stats are just for tuning your predictors.
+
+    printf("%s", result.heartbeats);
+    printf("  TRACE \t : %s", trace_path.c_str());
+    printf("  NUM_INSTRUCTIONS            \t : %10llu", result.instructions);
+    printf("  NUM_BR                      \t : %10llu", result.branches);
+    printf("  NUM_UNCOND_BR               \t : %10llu", result.uncond);
+    printf("  NUM_CONDITIONAL_BR          \t : %10llu", result.cond);
+    printf("  NUM_MISPREDICTIONS          \t : %10llu", result.mispred);
+    printf("  MISPRED_PER_1K_INST         \t : %10.4f",
+           1000.0 * (double) (result.mispred) / (double) (result.instructions));
+    printf("\n");
+}
+
+// Import the predictor module and return its PREDICTOR class (NULL after reporting the error)
+PyObject *LoadPredictorClass(const char *predictor_name) {
     // setup module
     PyObject *module_name = PyUnicode_FromString(predictor_name);
 
@@ -143,8 +217,7 @@ int main(int argc, char *argv[]) {
     if (module == NULL) {
         PyErr_Print();
         fprintf(stderr, "Fatal error: cannot import the module (is it in your PYTHONPATH?)\n");
-        pythonCleanup(program);
-        return 1;
+        return NULL;
     }
 
     // Builds the name of a callable class
@@ -153,66 +226,84 @@ int main(int argc, char *argv[]) {
     if (python_class == NULL) {
         PyErr_Print();
         fprintf(stderr, "Fatal error: cannot import the PREDICTOR class (is your predictor class \"PREDICTOR\"?)\n");
-        pythonCleanup(program);
-        return 1;
+        return NULL;
     }
-
-    // Creates an instance of the class
-    if (PyCallable_Check(python_class)) {
-        brpred = PyObject_CallObject(python_class, NULL);
-        Py_DECREF(python_class);
-    } else {
-        if (PyErr_Occurred())
-            PyErr_Print();
+    if (!PyCallable_Check(python_class)) {
         fprintf(stderr, "Fatal error: cannot instantiate the PREDICTOR class\n");
         Py_DECREF(python_class);
-        pythonCleanup(program);
-        return 1;
+        return NULL;
     }
+    return python_class;
+}
 
-    // Get relevant methods of PREDICTOR
-    PyObject *brpredGetPrediction = PyObject_GetAttrString(brpred, "GetPrediction");
-    if (brpredGetPrediction == NULL || !PyCallable_Check(brpredGetPrediction)) {
-        if (PyErr_Occurred())
-            PyErr_Print();
-        fprintf(stderr, "Fatal error: cannot use the PREDICTOR GetPrediction method\n");
-        Py_XDECREF(brpredGetPrediction);
+// Simulate one trace with a new instance of python_class; false after reporting a Python error
+bool SimulateTrace(const std::string &trace_path, PyObject *python_class, TraceResult &result) {
+    // PREDICTOR *brpred = new PREDICTOR();  // this instantiates the predictor code
+    PyObject *brpred = PyObject_CallObject(python_class, NULL);
+    if (brpred == NULL) {
+        PyErr_Print();
+        fprintf(stderr, "Fatal error: cannot instantiate the PREDICTOR class\n");
+        return false;
+    }
+
+    // Compiled predictors can bypass the interpreter entirely
+    PythonNative native;
+    int has_native = InitPythonNative(native, brpred);
+    if (has_native < 0) {
+        PyErr_Print();
+        fprintf(stderr, "Fatal error: cannot use the PREDICTOR __cbp_native__ callbacks\n");
+        FreePythonNative(native);
         Py_DECREF(brpred);
-        pythonCleanup(program);
-        return 1;
+        return false;
     }
 
-    PyObject *brpredUpdatePredictor = PyObject_GetAttrString(brpred, "UpdatePredictor");
-    if (brpredUpdatePredictor == NULL || !PyCallable_Check(brpredUpdatePredictor)) {
-        if (PyErr_Occurred())
-            PyErr_Print();
-        fprintf(stderr, "Fatal error: cannot use the PREDICTOR UpdatePredictor method\n");
-        Py_XDECREF(brpredUpdatePredictor);
+    // Get relevant methods of PREDICTOR
+    PythonCalls calls;
+    const char *failed = NULL;
+    if (!has_native && !InitPythonCalls(calls, brpred, &failed)) {
+        PyErr_Print();
+        fprintf(stderr, "Fatal error: cannot use the PREDICTOR %s method\n", failed);
+        FreePythonCalls(calls);
         Py_DECREF(brpred);
-        pythonCleanup(program);
-        return 1;
+        return false;
     }
 
-    PyObject *brpredTrackOtherInst = PyObject_GetAttrString(brpred, "TrackOtherInst");
-    if (brpredTrackOtherInst == NULL || !PyCallable_Check(brpredTrackOtherInst)) {
-        if (PyErr_Occurred())
-            PyErr_Print();
-        fprintf(stderr, "Fatal error: cannot use the PREDICTOR TrackOtherInst method\n");
-        Py_XDECREF(brpredTrackOtherInst);
+    // Optional batch protocol
+    PythonBatch batch;
+    long batch_size = has_native ? 0 : PythonBatchSize(brpred);
+    if (batch_size < 0 || (batch_size > 0 && !InitPythonBatch(batch, brpred, (size_t) batch_size))) {
+        PyErr_Print();
+        fprintf(stderr, "Fatal error: cannot use the PREDICTOR batch protocol (BATCH_SIZE > 0 needs NumPy)\n");
+        FreePythonBatch(batch);
+        FreePythonCalls(calls);
         Py_DECREF(brpred);
-        pythonCleanup(program);
-        return 1;
+        return false;
     }
 
-    Py_DECREF(brpred);
-    // End Python init
+    // hooks left to BASEPREDICTOR are no-ops and never called
+    static std::atomic<bool> hooks_reported(false);
+    if (!hooks_reported.exchange(true)) {
+        if (has_native) {
+            fprintf(stderr, "PREDICTOR hooks: native %s\n",
+                    native.process_batch ? "process_batch" :
+                    native.track_other ? "get_prediction update track_other" : "get_prediction update");
+        } else if (batch.capacity) {
+            fprintf(stderr, "PREDICTOR hooks: GetPredictionBatch%s%s (BATCH_SIZE %ld)\n",
+                    batch.updateBatchActive ? " UpdateBatch" : "",
+                    batch.observeBatchActive ? " ObserveBatch" : "", batch_size);
+        } else {
+            fprintf(stderr, "PREDICTOR hooks: GetPrediction%s%s\n",
+                    calls.updatePredictorActive ? " UpdatePredictor" : "",
+                    calls.trackOtherInstActive ? " TrackOtherInst" : "");
+        }
+    }
+
+    // End Python init (brpred is kept until the end: it may own the native state)
 
     ///////////////////////////////////////////////
     // read each trace recrod, simulate until done
     ///////////////////////////////////////////////
 
-    std::string trace_path;
-    trace_path = argv[1];
     bt9::BT9Reader bt9_reader(trace_path);
 
     std::string key = "total_instruction_count:";
@@ -232,195 +323,528 @@ int main(int argc, char *argv[]) {
     // read each trace record, simulate until done
     ///////////////////////////////////////////////
 
-    OpType opType;
-    UINT64 PC;
-    bool branchTaken;
-    UINT64 branchTarget;
     UINT64 numIter = 0;
-
-    PyObject *PyPredDir;
-    PyObject *PyTemp;
-    PyObject *PyTempValue;
-
-    for (auto it = bt9_reader.begin(); it != bt9_reader.end(); ++it) {
-        CheckHeartBeat(++numIter, numMispred); //Here numIter will be equal to number of branches read
-
-        try {
-            bt9::BrClass br_class = it->getSrcNode()->brClass();
-
-            //JD2_2_2016 break down branch instructions into all possible types
-            opType = OPTYPE_ERROR;
-
-            if ((br_class.type == bt9::BrClass::Type::UNKNOWN) &&
-                (it->getSrcNode()->brNodeIndex())) { //only fault if it isn't the first node in the graph (fake branch)
-                opType = OPTYPE_ERROR; //sanity check
-            } else if (br_class.type == bt9::BrClass::Type::RET) {
-                if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL)
-                    opType = OPTYPE_RET_COND;
-                else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL)
-                    opType = OPTYPE_RET_UNCOND;
-                else {
-                    opType = OPTYPE_ERROR;
+    bool ok = true;
+
+    cbp_branch_record rec;
+
+    CallProfile *profile = Profile ? new CallProfile() : NULL;
+    calls.profile = profile;
+    uint64_t start = 0;
+
+    // the trace is decoded on another thread while this one runs the Python predictor
+    DecodeAhead decoder(bt9_reader);
+    const cbp_branch_record *recs;
+    size_t num_recs, num_skipped;
+    bool more;
+
+    if (has_native) {
+        // nothing below touches the interpreter
+        std::vector<cbp_branch_record> native_recs(DECODE_AHEAD_CHUNK);
+        Py_BEGIN_ALLOW_THREADS
+            while (true) {
+                start = profile ? ReadTSC() : 0;
+                more = decoder.acquire(recs, num_recs, num_skipped);
+                ProfilePhase(profile, PHASE_DECODE, start);
+                if (!more) {
+                    break;
                 }
-            } else if (br_class.directness == bt9::BrClass::Directness::INDIRECT) {
-                if (br_class.type == bt9::BrClass::Type::CALL) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL)
-                        opType = OPTYPE_CALL_INDIRECT_COND;
-                    else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL)
-                        opType = OPTYPE_CALL_INDIRECT_UNCOND;
-                    else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else if (br_class.type == bt9::BrClass::Type::JMP) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL)
-                        opType = OPTYPE_JMP_INDIRECT_COND;
-                    else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL)
-                        opType = OPTYPE_JMP_INDIRECT_UNCOND;
-                    else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else {
-                    opType = OPTYPE_ERROR;
+                for (size_t i = 0; i < num_skipped; i++) { // the dummy branch at the beginning of the trace
+                    CheckHeartBeat(++numIter, numMispred);
                 }
-            } else if (br_class.directness == bt9::BrClass::Directness::DIRECT) {
-                if (br_class.type == bt9::BrClass::Type::CALL) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL) {
-                        opType = OPTYPE_CALL_DIRECT_COND;
-                    } else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL) {
-                        opType = OPTYPE_CALL_DIRECT_UNCOND;
-                    } else {
-                        opType = OPTYPE_ERROR;
-                    }
-                } else if (br_class.type == bt9::BrClass::Type::JMP) {
-                    if (br_class.conditionality == bt9::BrClass::Conditionality::CONDITIONAL) {
-                        opType = OPTYPE_JMP_DIRECT_COND;
-                    } else if (br_class.conditionality == bt9::BrClass::Conditionality::UNCONDITIONAL) {
-                        opType = OPTYPE_JMP_DIRECT_UNCOND;
+                std::copy(recs, recs + num_recs, native_recs.begin());
+                decoder.release();
+
+                start = profile ? ReadTSC() : 0;
+                RunPythonNative(native, native_recs.data(), num_recs);
+                ProfilePhase(profile, PHASE_NATIVE, start);
+                for (size_t i = 0; i < num_recs; i++) {
+                    CheckHeartBeat(++numIter, numMispred);
+                    if (native_recs[i].conditional) {
+                        cond_branch_instruction_counter++;
+                        if (native_recs[i].predDir != native_recs[i].branchTaken) {
+                            numMispred++;
+                        }
                     } else {
-                        opType = OPTYPE_ERROR;
+                        uncond_branch_instruction_counter++;
                     }
-                } else {
-                    opType = OPTYPE_ERROR;
                 }
-            } else {
-                opType = OPTYPE_ERROR;
             }
+        Py_END_ALLOW_THREADS
+    }
 
-            PC = it->getSrcNode()->brVirtualAddr();
+    while (ok && !has_native) {
+        start = profile ? ReadTSC() : 0;
+        Py_BEGIN_ALLOW_THREADS
+            more = decoder.acquire(recs, num_recs, num_skipped);
+        Py_END_ALLOW_THREADS
+        ProfilePhase(profile, PHASE_DECODE, start);
+        if (!more) {
+            break;
+        }
 
-            branchTaken = it->getEdge()->isTakenPath();
-            branchTarget = it->getEdge()->brVirtualTarget();
+        for (size_t i = 0; i < num_skipped; i++) { // the dummy branch at the beginning of the trace
+            CheckHeartBeat(++numIter, numMispred);
+        }
 
-/************************************************************************************************************/
+        for (size_t i = 0; i < num_recs; i++) {
+            const cbp_branch_record &br = recs[i];
+            if (br.conditional) {
+                cond_branch_instruction_counter++;
+            } else {
+                uncond_branch_instruction_counter++;
+            }
 
-            if (opType == OPTYPE_ERROR) {
-                if (it->getSrcNode()->brNodeIndex()) { //only fault if it isn't the first node in the graph (fake branch)
-                    fprintf(stderr, "OPTYPE_ERROR\n");
-                    printf("OPTYPE_ERROR\n");
-                    Py_DECREF(brpredGetPrediction);
-                    Py_DECREF(brpredUpdatePredictor);
-                    Py_DECREF(brpredTrackOtherInst);
-                    pythonCleanup(program);
-                    exit(-1); //this should never happen, if it does please email CBP org chair.
+            if (batch.capacity) { // batched branches are accounted for when their batch is flushed
+                batch.records->recs[batch.size++] = br;
+                if (batch.size == batch.capacity && !FlushPythonBatch(batch, numIter, numMispred, profile)) {
+                    ok = false;
+                    break;
                 }
-            } else if (br_class.conditionality ==
-                       bt9::BrClass::Conditionality::CONDITIONAL) { //JD2_17_2016 call UpdatePredictor() for all branches that decode as conditional
+                continue;
+            }
+
+            CheckHeartBeat(++numIter, numMispred); //Here numIter will be equal to number of branches read
+            calls.timed = profile && profile->sampleBranch();
 
-                bool predDir = false;
+            if (br.conditional) { //JD2_17_2016 call UpdatePredictor() for all branches that decode as conditional
+                rec = br;
 
                 // predDir = brpred->GetPrediction(PC);
-                PyTempValue = Py_BuildValue("(I)", PC);
-                PyPredDir = PyObject_CallObject(brpredGetPrediction, PyTempValue);
-                if (PyPredDir == NULL) {
+                int predicted = PythonGetPrediction(calls, rec.PC);
+                if (predicted < 0) {
                     PyErr_Print();
                     fprintf(stderr, "Fatal error: did not call PREDICTOR GetPrediction successfully.");
-                    Py_XDECREF(PyTempValue);
-                    Py_DECREF(brpredGetPrediction);
-                    Py_DECREF(brpredUpdatePredictor);
-                    Py_DECREF(brpredTrackOtherInst);
-                    pythonCleanup(program);
-                    exit(1);
+                    ok = false;
+                    break;
                 }
-                Py_DECREF(PyTempValue);
-                predDir = (bool) PyObject_IsTrue(PyPredDir);
-                Py_DECREF(PyPredDir);
+                rec.predDir = predicted;
 
 //                brpred->UpdatePredictor(PC, opType, branchTaken, predDir, branchTarget);
-                PyTempValue = Py_BuildValue("(I,l,i,i,I)", PC, opType, branchTaken, predDir, branchTarget);
-                PyTemp = PyObject_CallObject(brpredUpdatePredictor, PyTempValue);
-                if (PyTemp == NULL) {
+                if (!PythonUpdatePredictor(calls, rec)) {
                     PyErr_Print();
                     fprintf(stderr, "Fatal error: did not call PREDICTOR UpdatePredictor successfully.");
-                    Py_XDECREF(PyTempValue);
-                    Py_DECREF(brpredGetPrediction);
-                    Py_DECREF(brpredUpdatePredictor);
-                    Py_DECREF(brpredTrackOtherInst);
-                    pythonCleanup(program);
-                    exit(1);
+                    ok = false;
+                    break;
                 }
-                Py_DECREF(PyTempValue);
-                Py_DECREF(PyTemp);
 
-                if (predDir != branchTaken) {
+                if (rec.predDir != rec.branchTaken) {
                     numMispred++; // update mispred stats
                 }
-
-                cond_branch_instruction_counter++;
-            } else if (br_class.conditionality ==
-                       bt9::BrClass::Conditionality::UNCONDITIONAL) { // for predictors that want to track unconditional branches
-                uncond_branch_instruction_counter++;
+            } else { // for predictors that want to track unconditional branches
                 // brpred->TrackOtherInst(PC, opType, branchTaken, branchTarget);
-                // TODO: add error checking here???
-                PyTempValue = Py_BuildValue("(I,l,i,I)", PC, opType, branchTaken, branchTarget);
-                PyTemp = PyObject_CallObject(brpredTrackOtherInst, PyTempValue);
-                if (PyTemp == NULL) {
+                if (!PythonTrackOtherInst(calls, br)) {
                     PyErr_Print();
                     fprintf(stderr, "Fatal error: did not call PREDICTOR TrackOtherInst successfully.");
-                    Py_XDECREF(PyTempValue);
-                    Py_DECREF(brpredGetPrediction);
-                    Py_DECREF(brpredUpdatePredictor);
-                    Py_DECREF(brpredTrackOtherInst);
-                    pythonCleanup(program);
-                    exit(1);
+                    ok = false;
+                    break;
                 }
-                Py_DECREF(PyTempValue);
-                Py_DECREF(PyTemp);
-            } else {
-                fprintf(stderr, "CONDITIONALITY ERROR\n");
-                printf("CONDITIONALITY ERROR\n");
-                pythonCleanup(program);
-                exit(-1); //this should never happen, if it does please email CBP org chair.
             }
+        }
+        decoder.release();
+    }
+
+
+    ok = ok && FlushPythonBatch(batch, numIter, numMispred, profile);
+
+    if (profile != NULL) {
+        if (!has_native && !batch.capacity) {
+            profile->setCalls(PHASE_GET_MARSHAL, cond_branch_instruction_counter);
+            profile->setCalls(PHASE_GET_PYTHON, cond_branch_instruction_counter);
+            if (calls.updatePredictorActive) {
+                profile->setCalls(PHASE_UPDATE_MARSHAL, cond_branch_instruction_counter);
+                profile->setCalls(PHASE_UPDATE_PYTHON, cond_branch_instruction_counter);
+            }
+            if (calls.trackOtherInstActive) {
+                profile->setCalls(PHASE_TRACK_MARSHAL, uncond_branch_instruction_counter);
+                profile->setCalls(PHASE_TRACK_PYTHON, uncond_branch_instruction_counter);
+            }
+        }
+        profile->print(stderr, trace_path);
+        delete profile;
+    }
+
+    FreePythonBatch(batch);
+    FreePythonCalls(calls);
+    FreePythonNative(native);
+    Py_DECREF(brpred);
+
+    result.instructions = total_instruction_counter;
+    result.branches = branch_instruction_counter - 1; //JD2_2_2016 NOTE there is a dummy branch at the beginning of the trace...
+    result.uncond = uncond_branch_instruction_counter;
+    result.cond = cond_branch_instruction_counter;
+    result.mispred = numMispred;
+    return ok;
+}
+
+// Indices of the traces, largest file first, so that a long trace does not start last
+std::vector<size_t> TracesLargestFirst(const std::vector<std::string> &trace_paths) {
+    std::vector<size_t> order(trace_paths.size());
+    std::vector<off_t> sizes(trace_paths.size());
+    for (size_t i = 0; i < trace_paths.size(); i++) {
+        struct stat st;
+        order[i] = i;
+        sizes[i] = stat(trace_paths[i].c_str(), &st) == 0 ? st.st_size : 0;
+    }
+    std::stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+    return order;
+}
+
+// Print the statistics of the traces of a pool in the order given; returns the number of failed traces
+size_t PrintPoolResults(const std::vector<std::string> &trace_paths, const TraceResult *results) {
+    // traces of crashed workers are left RUNNING, the rest of the queue PENDING
+    size_t num_traces = trace_paths.size();
+    size_t num_failed = 0;
+    double mpki_sum = 0.0;
+    for (size_t i = 0; i < num_traces; i++) {
+        if (results[i].state == TRACE_DONE) {
+            PrintTraceStats(trace_paths[i], results[i]);
+            mpki_sum += 1000.0 * (double) results[i].mispred / (double) results[i].instructions;
+        } else {
+            printf("  TRACE \t : %s  FAILED\n", trace_paths[i].c_str());
+            num_failed++;
+        }
+    }
+    fflush(stdout);
+    // the summary goes to stderr: stdout has one line per trace, as in a sequential run
+    fprintf(stderr, "  NUM_TRACES                  \t : %10zu", num_traces);
+    fprintf(stderr, "  NUM_FAILED                  \t : %10zu", num_failed);
+    fprintf(stderr, "  MEAN_MISPRED_PER_1K_INST    \t : %10.4f\n",
+            num_failed < num_traces ? mpki_sum / (double) (num_traces - num_failed) : 0.0);
+    return num_failed;
+}
+
+/*!
+ * \brief Simulate traces in a pool of forked worker processes (simpython --jobs)
+ *
+ * Each worker has its own interpreter and takes the next trace, largest first, from a
+ * queue in shared memory until none are left; the statistics are written back to shared
+ * memory and printed by the parent in the order the traces were given. With preload the
+ * predictor module was already imported (python_class) and the workers inherit it.
+ * \return the number of traces that could not be simulated
+ */
+size_t RunJobs(const std::vector<std::string> &trace_paths, int jobs, const char *predictor_name,
+               PyObject *python_class) {
+    size_t num_traces = trace_paths.size();
+    std::vector<size_t> order = TracesLargestFirst(trace_paths);
+
+    // the queue head followed by one result per trace
+    size_t shared_size = sizeof(size_t) + num_traces * sizeof(TraceResult);
+    void *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("Fatal error: cannot map the job queue");
+        exit(-1);
+    }
+    size_t *next_trace = (size_t *) shared;
+    TraceResult *results = new((char *) shared + sizeof(size_t)) TraceResult[num_traces];
+    *next_trace = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    std::vector<pid_t> workers;
+    for (int w = 0; w < jobs && (size_t) w < num_traces; w++) {
+        if (python_class != NULL) {
+            PyOS_BeforeFork();
+        }
+        pid_t pid = fork();
+        if (pid != 0) {
+            if (python_class != NULL) {
+                PyOS_AfterFork_Parent();
+            }
+            if (pid < 0) {
+                perror("Fatal error: cannot fork a worker");
+                break;
+            }
+            workers.push_back(pid);
+            continue;
+        }
 
-/************************************************************************************************************/
+        // worker: the parent prints all the results once every worker has finished
+        PyObject *worker_class = python_class;
+        if (worker_class != NULL) {
+            PyOS_AfterFork_Child();
+        } else {
+            Py_Initialize();
+            worker_class = LoadPredictorClass(predictor_name);
         }
-        catch (const std::out_of_range &ex) {
-            std::cout << ex.what() << '\n';
+        int status = worker_class == NULL;
+        while (worker_class != NULL) {
+            size_t next = __atomic_fetch_add(next_trace, 1, __ATOMIC_RELAXED);
+            if (next >= num_traces) {
+                break;
+            }
+            TraceResult &result = results[order[next]];
+            HeartBeatLog = result.heartbeats;
+            result.state = TRACE_RUNNING;
+            result.state = SimulateTrace(trace_paths[order[next]], worker_class, result) ? TRACE_DONE : TRACE_FAILED;
+        }
+        Py_XDECREF(worker_class);
+        if (Py_FinalizeEx() < 0) {
+            status = 120;
+        }
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+
+    for (pid_t pid : workers) {
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+
+    size_t num_failed = PrintPoolResults(trace_paths, results);
+    munmap(shared, shared_size);
+    return num_failed;
+}
+
+#ifdef SIMPYTHON_THREADS
+// Trace queue of a --threads pool
+struct ThreadPoolQueue {
+    std::vector<size_t> order;
+    std::atomic<size_t> next;
+    std::vector<TraceResult> results;
+};
+
+// Simulate traces from the queue until it is empty (the caller holds its interpreter's GIL)
+void RunQueue(const std::vector<std::string> &trace_paths, ThreadPoolQueue &queue, PyObject *python_class) {
+    while (true) {
+        size_t next = queue.next.fetch_add(1);
+        if (next >= queue.order.size()) {
             break;
         }
+        TraceResult &result = queue.results[queue.order[next]];
+        HeartBeatLog = result.heartbeats;
+        result.state = TRACE_RUNNING;
+        result.state = SimulateTrace(trace_paths[queue.order[next]], python_class, result) ? TRACE_DONE : TRACE_FAILED;
+    }
+}
 
-    } //for (auto it = bt9_reader.begin(); it != bt9_reader.end(); ++it)
+#ifdef Py_GIL_DISABLED
+// free-threaded build: plain threads share the main interpreter and python_class
+void ThreadWorker(const std::vector<std::string> &trace_paths, ThreadPoolQueue &queue, PyObject *python_class) {
+    PyGILState_STATE gil = PyGILState_Ensure();
+    RunQueue(trace_paths, queue, python_class);
+    PyGILState_Release(gil);
+}
+#else
+// one sub-interpreter with its own GIL (PEP 684) per thread, which imports the module itself
+void ThreadWorker(const std::vector<std::string> &trace_paths, ThreadPoolQueue &queue, const char *predictor_name,
+                  PyInterpreterState *main_interp) {
+    // a sub-interpreter is created from a thread state of the main interpreter
+    PyThreadState *main_tstate = PyThreadState_New(main_interp);
+    PyEval_RestoreThread(main_tstate);
+
+    PyInterpreterConfig config;
+    memset(&config, 0, sizeof(config));
+    config.use_main_obmalloc = 0;
+    config.allow_fork = 0;
+    config.allow_exec = 0;
+    config.allow_threads = 1;
+    config.allow_daemon_threads = 0;
+    config.check_multi_interp_extensions = 1;
+    config.gil = PyInterpreterConfig_OWN_GIL;
+    PyThreadState *tstate = NULL;
+    PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+    if (PyStatus_Exception(status)) {
+        fprintf(stderr, "Fatal error: cannot create a sub-interpreter (%s)\n",
+                status.err_msg != NULL ? status.err_msg : "unknown error");
+        PyThreadState_Clear(main_tstate);
+        PyThreadState_DeleteCurrent();
+        return;
+    }
 
-    ///////////////////////////////////////////
-    //print_stats
-    ///////////////////////////////////////////
+    // the main interpreter's GIL was released, this thread now holds the new one
+    PyObject *python_class = LoadPredictorClass(predictor_name);
+    if (python_class != NULL) {
+        RunQueue(trace_paths, queue, python_class);
+        Py_DECREF(python_class);
+    }
+    Py_EndInterpreter(tstate);
 
-    //NOTE: competitors are judged solely on MISPRED_PER_1K_INST. The additional stats are just for tuning your predictors.
+    PyEval_RestoreThread(main_tstate);
+    PyThreadState_Clear(main_tstate);
+    PyThreadState_DeleteCurrent();
+}
+#endif
+
+/*!
+ * \brief Simulate traces on a pool of threads in this process (simpython --threads)
+ *
+ * Like --jobs, but every worker is a thread with a sub-interpreter that has its own GIL
+ * (Python 3.12+), or on a free-threaded build a plain thread; each trace still gets its
+ * own PREDICTOR instance. Extension modules the predictor imports must support
+ * sub-interpreters (or free threading). Needs an initialized interpreter.
+ * \return the number of traces that could not be simulated
+ */
+size_t RunThreads(const std::vector<std::string> &trace_paths, int threads, const char *predictor_name) {
+    ThreadPoolQueue queue;
+    queue.order = TracesLargestFirst(trace_paths);
+    queue.next = 0;
+    queue.results.resize(trace_paths.size());
+#ifdef Py_GIL_DISABLED
+    PyObject *python_class = LoadPredictorClass(predictor_name);
+    if (python_class == NULL) {
+        return PrintPoolResults(trace_paths, queue.results.data());
+    }
+#else
+    PyInterpreterState *main_interp = PyInterpreterState_Get();
+#endif
+
+    PyThreadState *main_tstate = PyEval_SaveThread();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads && (size_t) t < trace_paths.size(); t++) {
+#ifdef Py_GIL_DISABLED
+        workers.emplace_back(ThreadWorker, std::cref(trace_paths), std::ref(queue), python_class);
+#else
+        workers.emplace_back(ThreadWorker, std::cref(trace_paths), std::ref(queue), predictor_name, main_interp);
+#endif
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    PyEval_RestoreThread(main_tstate);
 
-    printf("  TRACE \t : %s", trace_path.c_str());
-    printf("  NUM_INSTRUCTIONS            \t : %10llu", total_instruction_counter);
-    printf("  NUM_BR                      \t : %10llu",
-           branch_instruction_counter - 1); //JD2_2_2016 NOTE there is a dummy branch at the beginning of the trace...
-    printf("  NUM_UNCOND_BR               \t : %10llu", uncond_branch_instruction_counter);
-    printf("  NUM_CONDITIONAL_BR          \t : %10llu", cond_branch_instruction_counter);
-    printf("  NUM_MISPREDICTIONS          \t : %10llu", numMispred);
-    printf("  MISPRED_PER_1K_INST         \t : %10.4f",
-           1000.0 * (double) (numMispred) / (double) (total_instruction_counter));
-    printf("\n");
+#ifdef Py_GIL_DISABLED
+    Py_DECREF(python_class);
+#endif
+    return PrintPoolResults(trace_paths, queue.results.data());
+}
+#endif
+
+// usage: simpython [--jobs <N> [--preload] | --threads <N>] [--profile] [--predictor <module>] <trace> [<trace> ...]
+//        simpython <trace> [<predictor_module>]
+
+int main(int argc, char *argv[]) {
+    const char *predictor_name = "dummy_predictor";
+    std::vector<std::string> trace_paths;
+    bool have_predictor = false;
+    int jobs = 1;
+    int threads = 1;
+    bool preload = false;
+    bool bad_args = false;
+
+    std::vector<char *> positional;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > 4096) {
+                bad_args = true;
+            }
+            jobs = (int) n;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > 4096) {
+                bad_args = true;
+            }
+            threads = (int) n;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            Profile = true;
+        } else if (strcmp(argv[i], "--preload") == 0) {
+            preload = true;
+        } else if (strcmp(argv[i], "--predictor") == 0 && i + 1 < argc) {
+            predictor_name = argv[++i];
+            have_predictor = true;
+        } else if (argv[i][0] != '-') {
+            positional.push_back(argv[i]);
+        } else {
+            bad_args = true;
+        }
+    }
+    // the original form: <trace> [<predictor_module>]
+    if (!have_predictor && positional.size() == 2) {
+        predictor_name = positional.back();
+        positional.pop_back();
+    }
+    trace_paths.assign(positional.begin(), positional.end());
+
+    if (trace_paths.empty() || bad_args || (jobs > 1 && threads > 1)) {
+        printf("usage: %s [--jobs <N> [--preload] | --threads <N>] [--profile] [--predictor <module>] "
+               "<trace> [<trace> ...]\n"
+               "       %s <trace> [<predictor_module>]\n", argv[0], argv[0]);
+        exit(-1);
+    }
+
+    for (const std::string &trace_path : trace_paths) {
+        if (access(trace_path.c_str(), R_OK) != 0) {
+            fprintf(stderr, "Fatal error: cannot read trace %s\n", trace_path.c_str());
+            exit(-1);
+        }
+    }
+
+#ifndef SIMPYTHON_THREADS
+    if (threads > 1) {
+        fprintf(stderr, "Fatal error: --threads needs sub-interpreters with their own GIL (Python 3.12+) or a "
+                        "free-threaded build, this simpython uses Python %s (use --jobs instead)\n", PY_VERSION);
+        exit(-1);
+    }
+#endif
+
+    // Check if .py, remove this to get module name
+    std::string module_name = predictor_name;
+    if (module_name.size() > 3 && module_name.compare(module_name.size() - 3, 3, ".py") == 0)
+        module_name.resize(module_name.size() - 3);
+
+    // Python init
+    wchar_t *program = Py_DecodeLocale(argv[0], NULL);
+    if (program == NULL) {
+        fprintf(stderr, "Fatal error: cannot decode argv[0]\n");
+        exit(1);
+    }
+    Py_SetProgramName(program);
+
+    if (jobs > 1) {
+        PyObject *python_class = NULL;
+        if (preload) { // import once, before forking
+            Py_Initialize();
+            python_class = LoadPredictorClass(module_name.c_str());
+            if (python_class == NULL) {
+                pythonCleanup(program);
+                return 1;
+            }
+        }
+        size_t num_failed = RunJobs(trace_paths, jobs, module_name.c_str(), python_class);
+        if (preload) {
+            Py_DECREF(python_class);
+            pythonCleanup(program);
+        } else {
+            PyMem_RawFree(program);
+        }
+        return num_failed ? 1 : 0;
+    }
+
+    Py_Initialize();
+#ifdef SIMPYTHON_THREADS
+    if (threads > 1) {
+        size_t num_failed = RunThreads(trace_paths, threads, module_name.c_str());
+        pythonCleanup(program);
+        return num_failed ? 1 : 0;
+    }
+#endif
+    PyObject *python_class = LoadPredictorClass(module_name.c_str());
+    if (python_class == NULL) {
+        pythonCleanup(program);
+        return 1;
+    }
+
+    for (const std::string &trace_path : trace_paths) {
+        TraceResult result;
+        if (!SimulateTrace(trace_path, python_class, result)) {
+            Py_DECREF(python_class);
+            pythonCleanup(program);
+            exit(1);
+        }
+
+        ///////////////////////////////////////////
+        //print_stats
+        ///////////////////////////////////////////
+
+        PrintTraceStats(trace_path, result);
+    }
 
-    Py_DECREF(brpredGetPrediction);
-    Py_DECREF(brpredUpdatePredictor);
-    Py_DECREF(brpredTrackOtherInst);
+    Py_DECREF(python_class);
     pythonCleanup(program);
     return 0;
 }
@@ -0,0 +1,370 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    bt9simpoint.cc
+ * \brief   Picks representative regions of BT9 traces (SimPoint-style)
+ *
+ * usage: bt9simpoint [--interval <branches>] [--max-k <K>] [--dims <D>] [--seed <S>]
+ *                    [--output <file>] <trace> [<trace> ...]
+ *
+ * Each trace is cut into intervals of --interval branches (default 1000000; a shorter
+ * last interval is merged into the one before it unless it is at least half as long). The
+ * signature of an interval is its branch vector, how often each static branch executed
+ * in it, normalized and randomly projected down to --dims dimensions (default 15). The
+ * signatures are clustered with k-means for k = 1 .. --max-k (default 10), and the
+ * smallest k whose Bayesian information criterion reaches 90% of the best one's is kept.
+ * Each cluster is represented by the interval closest to its centroid, weighted by the
+ * share of the branches of the trace in the cluster. The regions are written as
+ * sim_regions.h describes (to stdout by default), ready for simnlog --regions.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "bt9_reader.h"
+#include "branch_decode.h"
+#include "sim_regions.h"
+
+#define SIMPOINT_RESTARTS 5        // k-means runs per k, from different seeds
+#define SIMPOINT_ITERATIONS 100    // k-means iterations per run, at most
+#define SIMPOINT_BIC_THRESHOLD 0.9
+
+// Signatures of the intervals of one trace
+struct Intervals {
+    size_t dims = 0;
+    std::vector<double> points;       // dims values per interval
+    std::vector<uint64_t> branches;   // branches in each interval (the last one may differ)
+
+    size_t size() const {
+        return branches.size();
+    }
+
+    const double *point(size_t i) const {
+        return &points[i * dims];
+    }
+};
+
+// Clusters of the intervals
+struct Clustering {
+    size_t k = 0;
+    std::vector<double> centroids;    // dims values per cluster
+    std::vector<size_t> assignment;   // cluster of each interval
+    double distortion = 0.0;          // sum of the squared distances to the centroids
+    double bic = 0.0;
+};
+
+static double SquaredDistance(const double *a, const double *b, size_t dims) {
+    double sum = 0.0;
+    for (size_t d = 0; d < dims; d++) {
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    }
+    return sum;
+}
+
+/// Entry of the random projection matrix, uniform in [-1, 1), for node and dimension dim
+static double Projection(uint32_t node, size_t dim, uint64_t seed) {
+    uint64_t x = seed ^ ((uint64_t) node << 20) ^ dim;
+    // splitmix64 finalizer: the matrix is never stored
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (double) (x >> 11) / (double) (1ULL << 52) - 1.0;
+}
+
+// Stream a trace and project the branch vector of each interval
+static void ReadIntervals(const std::string &trace_path, uint64_t interval, size_t dims, uint64_t seed,
+                          Intervals &intervals) {
+    intervals.dims = dims;
+    bt9::BT9Reader reader(trace_path);
+    std::vector<uint64_t> counts;
+    std::vector<uint32_t> touched;   // nodes with a count in the current interval
+    uint64_t size = 0;
+
+    auto finish = [&]() {
+        size_t base = intervals.points.size();
+        intervals.points.resize(base + dims, 0.0);
+        for (uint32_t node : touched) {
+            double share = (double) counts[node] / (double) size;
+            for (size_t d = 0; d < dims; d++) {
+                intervals.points[base + d] += share * Projection(node, d, seed);
+            }
+            counts[node] = 0;
+        }
+        intervals.branches.push_back(size);
+        touched.clear();
+        size = 0;
+    };
+
+    cbp_branch_record rec;
+    for (auto it = reader.begin(); it != reader.end(); ++it) {
+        try {
+            if (!decodeBranchRecord(*it, rec)) {
+                continue;
+            }
+        }
+        catch (const std::out_of_range &ex) {
+            std::cout << ex.what() << '\n';
+            break;
+        }
+        uint32_t node = it->getSrcNode()->brNodeIndex();
+        if (node >= counts.size()) {
+            counts.resize((size_t) node + 1, 0);
+        }
+        if (counts[node]++ == 0) {
+            touched.push_back(node);
+        }
+        if (++size == interval) {
+            finish();
+        }
+    }
+    if (size > 0 && size < interval / 2 && intervals.size() > 0) {
+        // too short to be clustered on its own: it goes with the interval before it
+        intervals.branches.back() += size;
+    } else if (size > 0) {
+        finish();
+    }
+}
+
+// k-means with k-means++ seeding; the best of SIMPOINT_RESTARTS runs
+static Clustering KMeans(const Intervals &intervals, size_t k, std::mt19937_64 &rng) {
+    size_t n = intervals.size(), dims = intervals.dims;
+    Clustering best;
+    best.distortion = std::numeric_limits<double>::infinity();
+
+    for (int run = 0; run < SIMPOINT_RESTARTS; run++) {
+        Clustering c;
+        c.k = k;
+        c.centroids.resize(k * dims);
+        c.assignment.assign(n, 0);
+
+        std::vector<double> nearest(n, std::numeric_limits<double>::infinity());
+        size_t first = std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+        std::copy(intervals.point(first), intervals.point(first) + dims, c.centroids.begin());
+        for (size_t j = 1; j < k; j++) {
+            double total = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                nearest[i] = std::min(nearest[i],
+                                      SquaredDistance(intervals.point(i), &c.centroids[(j - 1) * dims], dims));
+                total += nearest[i];
+            }
+            size_t pick = 0;
+            if (total > 0.0) {
+                double target = std::uniform_real_distribution<double>(0.0, total)(rng);
+                for (pick = 0; pick + 1 < n && (target -= nearest[pick]) > 0.0; pick++) {
+                }
+            } else {
+                pick = std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+            }
+            std::copy(intervals.point(pick), intervals.point(pick) + dims, c.centroids.begin() + j * dims);
+        }
+
+        for (int iteration = 0; iteration < SIMPOINT_ITERATIONS; iteration++) {
+            bool changed = iteration == 0;
+            c.distortion = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                size_t closest = 0;
+                double closest_distance = std::numeric_limits<double>::infinity();
+                for (size_t j = 0; j < k; j++) {
+                    double distance = SquaredDistance(intervals.point(i), &c.centroids[j * dims], dims);
+                    if (distance < closest_distance) {
+                        closest = j;
+                        closest_distance = distance;
+                    }
+                }
+                changed = changed || c.assignment[i] != closest;
+                c.assignment[i] = closest;
+                c.distortion += closest_distance;
+            }
+            if (!changed) {
+                break;
+            }
+            std::vector<double> sums(k * dims, 0.0);
+            std::vector<size_t> members(k, 0);
+            for (size_t i = 0; i < n; i++) {
+                members[c.assignment[i]]++;
+                for (size_t d = 0; d < dims; d++) {
+                    sums[c.assignment[i] * dims + d] += intervals.point(i)[d];
+                }
+            }
+            for (size_t j = 0; j < k; j++) {
+                // an empty cluster keeps its centroid
+                for (size_t d = 0; members[j] > 0 && d < dims; d++) {
+                    c.centroids[j * dims + d] = sums[j * dims + d] / (double) members[j];
+                }
+            }
+        }
+        if (c.distortion < best.distortion) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+/// Bayesian information criterion of a clustering (spherical Gaussians, as in X-means)
+static double BIC(const Intervals &intervals, const Clustering &c) {
+    double r = (double) intervals.size(), m = (double) intervals.dims, k = (double) c.k;
+    double variance = r > k ? c.distortion / (m * (r - k)) : 0.0;
+    variance = std::max(variance, 1e-12);
+    std::vector<size_t> members(c.k, 0);
+    for (size_t cluster : c.assignment) {
+        members[cluster]++;
+    }
+    double likelihood = -r * m / 2.0 * log(2.0 * M_PI * variance) - c.distortion / (2.0 * variance);
+    for (size_t size : members) {
+        if (size > 0) {
+            likelihood += (double) size * log((double) size / r);
+        }
+    }
+    double parameters = (k - 1.0) + m * k + 1.0;
+    return likelihood - parameters / 2.0 * log(r);
+}
+
+static Clustering PickClustering(const Intervals &intervals, size_t max_k, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<Clustering> candidates;
+    double min_bic = std::numeric_limits<double>::infinity(), max_bic = -min_bic;
+    for (size_t k = 1; k <= std::min(max_k, intervals.size()); k++) {
+        candidates.push_back(KMeans(intervals, k, rng));
+        candidates.back().bic = BIC(intervals, candidates.back());
+        min_bic = std::min(min_bic, candidates.back().bic);
+        max_bic = std::max(max_bic, candidates.back().bic);
+    }
+    for (const Clustering &c : candidates) {
+        if (c.bic >= min_bic + SIMPOINT_BIC_THRESHOLD * (max_bic - min_bic)) {
+            return c;
+        }
+    }
+    return candidates.back();
+}
+
+static bool WriteRegions(FILE *out, const std::string &trace_path, uint64_t interval, const Intervals &intervals,
+                         const Clustering &c) {
+    uint64_t total = 0;
+    std::vector<uint64_t> starts;
+    for (uint64_t size : intervals.branches) {
+        starts.push_back(total);
+        total += size;
+    }
+
+    std::vector<SimRegion> regions;
+    for (size_t j = 0; j < c.k; j++) {
+        size_t representative = SIZE_MAX;
+        double closest = std::numeric_limits<double>::infinity();
+        uint64_t members = 0;
+        for (size_t i = 0; i < intervals.size(); i++) {
+            if (c.assignment[i] != j) {
+                continue;
+            }
+            members += intervals.branches[i];
+            double distance = SquaredDistance(intervals.point(i), &c.centroids[j * intervals.dims], intervals.dims);
+            if (distance < closest) {
+                representative = i;
+                closest = distance;
+            }
+        }
+        if (representative != SIZE_MAX) {
+            regions.push_back({starts[representative], intervals.branches[representative],
+                               (double) members / (double) total});
+        }
+    }
+    std::sort(regions.begin(), regions.end(), [](const SimRegion &a, const SimRegion &b) {
+        return a.start < b.start;
+    });
+
+    uint64_t simulated = 0;
+    for (const SimRegion &region : regions) {
+        simulated += region.branches;
+    }
+    fprintf(out, "# %s: %zu intervals of %llu branches, k = %zu (BIC %.1f), %llu of %llu branches (%.1fx fewer)\n",
+            trace_path.c_str(), intervals.size(), (unsigned long long) interval, c.k, c.bic,
+            (unsigned long long) simulated, (unsigned long long) total,
+            simulated ? (double) total / (double) simulated : 0.0);
+    std::string name = RegionTraceName(trace_path);
+    for (const SimRegion &region : regions) {
+        fprintf(out, "%s %llu %llu %.6f\n", name.c_str(), (unsigned long long) region.start,
+                (unsigned long long) region.branches, region.weight);
+    }
+    return fflush(out) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> trace_paths;
+    std::string output_path;
+    uint64_t interval = 1000000;
+    size_t max_k = 10;
+    size_t dims = 15;
+    uint64_t seed = 1;
+    bool bad_args = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool numeric = i + 1 < argc && (strcmp(argv[i], "--interval") == 0 || strcmp(argv[i], "--max-k") == 0 ||
+                                        strcmp(argv[i], "--dims") == 0 || strcmp(argv[i], "--seed") == 0);
+        if (numeric) {
+            char *end;
+            unsigned long long value = strtoull(argv[i + 1], &end, 10);
+            bad_args |= *end != '\0' || argv[i + 1][0] == '-' || (value == 0 && strcmp(argv[i], "--seed") != 0);
+            if (strcmp(argv[i], "--interval") == 0) {
+                interval = value;
+            } else if (strcmp(argv[i], "--max-k") == 0) {
+                max_k = (size_t) value;
+            } else if (strcmp(argv[i], "--dims") == 0) {
+                dims = (size_t) value;
+            } else {
+                seed = value;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (argv[i][0] != '-') {
+            trace_paths.push_back(argv[i]);
+        } else {
+            bad_args = true;
+        }
+    }
+
+    if (trace_paths.empty() || bad_args) {
+        printf("usage: %s [--interval <branches>] [--max-k <K>] [--dims <D>] [--seed <S>]\n"
+               "       [--output <file>] <trace> [<trace> ...]\n", argv[0]);
+        exit(-1);
+    }
+
+    FILE *out = stdout;
+    if (!output_path.empty()) {
+        out = fopen(output_path.c_str(), "w");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open %s for writing\n", output_path.c_str());
+            exit(-1);
+        }
+    }
+
+    int status = 0;
+    for (const std::string &trace_path : trace_paths) {
+        Intervals intervals;
+        ReadIntervals(trace_path, interval, dims, seed, intervals);
+        if (intervals.size() == 0) {
+            fprintf(stderr, "%s: no branches\n", trace_path.c_str());
+            status = 1;
+            continue;
+        }
+        Clustering clustering = PickClustering(intervals, max_k, seed);
+        if (!WriteRegions(out, trace_path, interval, intervals, clustering)) {
+            status = 1;
+        }
+    }
+    if (out != stdout && fclose(out) != 0) {
+        status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,309 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    bt9slice.cc
+ * \brief   Cuts a range of branches out of a BT9 trace into a smaller BT9 trace
+ *
+ * usage: bt9slice [--start <branch>] [--end <branch>] --output <file> <trace>
+ *
+ * The slice holds the branches [start, end) of the trace, counted from 0 without the dummy
+ * branch at the beginning of the trace (as simnlog counts them, and as sim_regions.h
+ * numbers regions). It only keeps the nodes and edges the slice uses (the destination
+ * node of its last edge included), renumbered in their original order, with their taken,
+ * not-taken, target and traverse counts and the behavior of the nodes recomputed for the
+ * slice. Like every BT9 trace it starts with the dummy node 0 and a dummy edge from it to
+ * the first branch, which carries the non-branch instructions before that branch, so the
+ * drivers skip it as usual. total_instruction_count and branch_instruction_count are
+ * recomputed; the other header fields are copied. An output name ending in .gz is gzipped.
+ *
+ * The trace is read twice: once through BT9Reader to find the edges of the slice, then as
+ * text to copy the lines of the nodes and edges it keeps.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "bt9_reader.h"
+#include "branch_decode.h"
+
+#define SLICE_NOT_KEPT UINT32_MAX
+
+// Counts of a node within the slice
+struct SliceNode {
+    uint32_t id = SLICE_NOT_KEPT;  // in the slice
+    uint64_t taken = 0;
+    uint64_t not_taken = 0;
+    std::set<uint64_t> targets;
+};
+
+// Edges of the slice in trace order, and what the slice keeps of the tables
+struct Slice {
+    uint64_t start = 0;
+    uint64_t end = 0;                      // clamped to the length of the trace
+    std::vector<uint32_t> sequence;        // original edge of each branch of the slice
+    uint64_t instructions_before = 0;      // non-branch instructions before the first branch
+    uint64_t instructions = 0;             // in the slice, the dummy branch included
+    std::map<uint32_t, SliceNode> nodes;   // by original id
+    std::map<uint32_t, uint32_t> edges;    // original id -> id in the slice
+    std::map<uint32_t, uint64_t> traversals;
+    uint32_t first_node = 0;               // original node of the first branch
+};
+
+static std::string Quote(const std::string &path) {
+    std::string quoted = "'";
+    for (char c : path) {
+        quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+}
+
+static bool EndsWith(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// First pass: the edges of the branches [start, end) and the counts of their nodes
+static bool FindSlice(const std::string &trace_path, Slice &slice) {
+    bt9::BT9Reader reader(trace_path);
+    cbp_branch_record rec;
+    uint64_t index = 0;
+    uint64_t last_instructions = 0;  // after the previous branch, the dummy one included
+    for (auto it = reader.begin(); it != reader.end() && index < slice.end; ++it) {
+        const bt9::BT9ReaderEdgeRecord *edge = it->getEdge();
+        try {
+            if (!decodeBranchRecord(*it, rec)) {
+                last_instructions = edge->nonBrInstCnt();
+                continue;
+            }
+        }
+        catch (const std::out_of_range &ex) {
+            std::cout << ex.what() << '\n';
+            break;
+        }
+        if (index == slice.start) {
+            slice.instructions_before = last_instructions;
+            slice.first_node = edge->srcNodeIndex();
+        }
+        if (index >= slice.start) {
+            slice.sequence.push_back(edge->edgeIndex());
+            slice.instructions += 1 + edge->nonBrInstCnt();
+            slice.traversals[edge->edgeIndex()]++;
+            SliceNode &node = slice.nodes[edge->srcNodeIndex()];
+            if (edge->isTakenPath()) {
+                node.taken++;
+            } else {
+                node.not_taken++;
+            }
+            node.targets.insert(edge->brVirtualTarget());
+            slice.nodes[edge->destNodeIndex()];
+        }
+        last_instructions = edge->nonBrInstCnt();
+        index++;
+    }
+    slice.end = std::min(slice.end, index);
+    if (slice.sequence.empty()) {
+        fprintf(stderr, "%s: no branches in [%llu, %llu)\n", trace_path.c_str(), (unsigned long long) slice.start,
+                (unsigned long long) slice.end);
+        return false;
+    }
+    slice.instructions += 1 + slice.instructions_before;  // the dummy branch
+
+    // node 0 stays the dummy node, edge 0 becomes the new dummy edge
+    slice.nodes[0];
+    uint32_t id = 0;
+    for (auto &node : slice.nodes) {
+        node.second.id = id++;
+    }
+    id = 1;
+    for (auto &edge : slice.traversals) {
+        slice.edges[edge.first] = id++;
+    }
+    return true;
+}
+
+/// The value following key in tokens (which it replaces), false if there is no key
+static bool ReplaceField(std::vector<std::string> &tokens, const char *key, const std::string &value) {
+    for (size_t i = 0; i + 1 < tokens.size(); i++) {
+        if (tokens[i] == key) {
+            tokens[i + 1] = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string Join(const std::vector<std::string> &tokens) {
+    std::string line;
+    for (const std::string &token : tokens) {
+        line += (line.empty() ? "" : " ") + token;
+    }
+    return line;
+}
+
+static std::vector<std::string> Split(const std::string &line) {
+    std::vector<std::string> tokens;
+    std::istringstream ss(line);
+    std::string token;
+    while (ss >> token) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// Second pass: copy the header and the kept nodes and edges, then write the sequence
+static bool WriteSlice(const std::string &trace_path, const Slice &slice, FILE *out) {
+    std::string cmd = (EndsWith(trace_path, ".gz") ? "gunzip -dc " : "/bin/cat ") + Quote(trace_path);
+    FILE *in = popen(cmd.c_str(), "r");
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open trace file '%s' with pipe\n", trace_path.c_str());
+        return false;
+    }
+
+    enum {HEADER, NODES, EDGES} section = HEADER;
+    bool first_line = true;
+    char *buffer = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&buffer, &capacity, in)) > 0) {
+        std::string line(buffer, (size_t) length);
+        if (!line.empty() && line.back() == '\n') {
+            line.pop_back();
+        }
+        size_t hash = line.find('#');
+        std::string comment = hash == std::string::npos ? "" : line.substr(hash);
+        std::vector<std::string> tokens = Split(line.substr(0, hash));
+
+        if (first_line) {
+            first_line = false;
+            fprintf(out, "%s\n# bt9slice: branches [%llu, %llu) of %s (the instruction mix counts are those of "
+                         "the whole trace)\n", line.c_str(), (unsigned long long) slice.start,
+                    (unsigned long long) slice.end, trace_path.c_str());
+            continue;
+        }
+        if (tokens.empty()) {
+            fprintf(out, "%s\n", line.c_str());
+            continue;
+        }
+
+        if (tokens[0] == "BT9_NODES") {
+            section = NODES;
+        } else if (tokens[0] == "BT9_EDGES") {
+            section = EDGES;
+            fprintf(out, "%s\n", line.c_str());
+            auto first = slice.nodes.find(slice.first_node);
+            fprintf(out, "EDGE 0 0 %u N 0x0 - %llu traverse_cnt: 1\n", first->second.id,
+                    (unsigned long long) slice.instructions_before);
+            continue;
+        } else if (tokens[0] == "BT9_EDGE_SEQUENCE") {
+            break;
+        } else if (section == HEADER && tokens[0] == "total_instruction_count:") {
+            line = "total_instruction_count: " + std::to_string(slice.instructions);
+        } else if (section == HEADER && tokens[0] == "branch_instruction_count:") {
+            line = "branch_instruction_count: " + std::to_string(slice.sequence.size() + 1);
+        } else if (section == NODES && tokens[0] == "NODE" && tokens.size() > 1) {
+            uint32_t id = (uint32_t) std::stoul(tokens[1], nullptr, 0);
+            auto node = slice.nodes.find(id);
+            if (node == slice.nodes.end()) {
+                continue;
+            }
+            if (id != 0) {
+                const SliceNode &counts = node->second;
+                tokens[1] = std::to_string(counts.id);
+                ReplaceField(tokens, "taken_cnt:", std::to_string(counts.taken));
+                ReplaceField(tokens, "not_taken_cnt:", std::to_string(counts.not_taken));
+                ReplaceField(tokens, "tgt_cnt:", std::to_string(counts.targets.size()));
+                std::string direction = counts.not_taken == 0 && counts.taken > 0 ? "AT" :
+                                        counts.taken == 0 ? "ANT" : "DYN";
+                ReplaceField(tokens, "behavior:", direction + (counts.targets.size() > 1 ? "+IND" : "+DIR"));
+                line = Join(tokens) + (comment.empty() ? "" : "  " + comment);
+            }
+        } else if (section == EDGES && tokens[0] == "EDGE" && tokens.size() > 3) {
+            uint32_t id = (uint32_t) std::stoul(tokens[1], nullptr, 0);
+            auto edge = slice.edges.find(id);
+            if (edge == slice.edges.end()) {
+                continue;
+            }
+            tokens[1] = std::to_string(edge->second);
+            tokens[2] = std::to_string(slice.nodes.at((uint32_t) std::stoul(tokens[2], nullptr, 0)).id);
+            tokens[3] = std::to_string(slice.nodes.at((uint32_t) std::stoul(tokens[3], nullptr, 0)).id);
+            ReplaceField(tokens, "traverse_cnt:", std::to_string(slice.traversals.at(id)));
+            line = Join(tokens) + (comment.empty() ? "" : "  " + comment);
+        }
+        fprintf(out, "%s\n", line.c_str());
+    }
+    free(buffer);
+    pclose(in);
+
+    fprintf(out, "BT9_EDGE_SEQUENCE\n0\n");
+    for (uint32_t edge : slice.sequence) {
+        fprintf(out, "%u\n", slice.edges.at(edge));
+    }
+    fprintf(out, "EOF\n");
+    return section == EDGES;
+}
+
+int main(int argc, char *argv[]) {
+    std::string trace_path;
+    std::string output_path;
+    Slice slice;
+    slice.end = UINT64_MAX;
+    bool bad_args = false;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--start") == 0 || strcmp(argv[i], "--end") == 0) && i + 1 < argc) {
+            char *end;
+            unsigned long long value = strtoull(argv[i + 1], &end, 10);
+            bad_args |= *end != '\0' || argv[i + 1][0] == '-' || argv[i + 1][0] == '\0';
+            (strcmp(argv[i], "--start") == 0 ? slice.start : slice.end) = value;
+            i++;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (argv[i][0] != '-' && trace_path.empty()) {
+            trace_path = argv[i];
+        } else {
+            bad_args = true;
+        }
+    }
+
+    if (trace_path.empty() || output_path.empty() || slice.start >= slice.end || bad_args) {
+        printf("usage: %s [--start <branch>] [--end <branch>] --output <file> <trace>\n", argv[0]);
+        exit(-1);
+    }
+
+    if (!FindSlice(trace_path, slice)) {
+        exit(-1);
+    }
+
+    bool gzipped = EndsWith(output_path, ".gz");
+    FILE *out = gzipped ? popen(("gzip -c > " + Quote(output_path)).c_str(), "w") : fopen(output_path.c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open %s for writing\n", output_path.c_str());
+        exit(-1);
+    }
+    bool ok = WriteSlice(trace_path, slice, out);
+    ok = (gzipped ? pclose(out) : fclose(out)) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Error occurred at writing time (%s)!\n", output_path.c_str());
+        return 1;
+    }
+
+    printf("  TRACE \t : %s", trace_path.c_str());
+    printf("  SLICE                       \t : [%llu, %llu)", (unsigned long long) slice.start,
+           (unsigned long long) slice.end);
+    printf("  NUM_INSTRUCTIONS            \t : %10llu", (unsigned long long) slice.instructions);
+    printf("  NUM_BR                      \t : %10zu", slice.sequence.size());
+    printf("  NODES                       \t : %10zu", slice.nodes.size());
+    printf("  EDGES                       \t : %10zu", slice.edges.size() + 1);
+    printf("  OUTPUT \t : %s\n", output_path.c_str());
+    return 0;
+}
@@ -0,0 +1,406 @@
+///////////////////////////////////////////////////////////////////////
+//  Copyright 2020 Zach Carmichael                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*!
+ * \file    bt9stat.cc
+ * \brief   Statistics of BT9 traces, without a predictor
+ *
+ * usage: bt9stat [--static] [--top <N>] [--per-pc <file.csv>] <trace> [<trace> ...]
+ *
+ * Streams each trace once and reports its branch mix per OpType, static and dynamic
+ * footprint, taken rate, the most executed branches with their taken and transition rates
+ * (how often a branch goes the other way than on its previous execution), and the reuse
+ * distance histogram of the branches: the number of distinct branches executed between
+ * two executions of the same branch, which is what a fully-associative LRU table of that
+ * many entries would need to hit.
+ *
+ * --static answers what it can from the node and edge tables alone (the taken/not-taken
+ * counts of the nodes, the traverse counts of the edges) without streaming the edge
+ * sequence: mix, footprint, taken rate and most executed branches, but no transition
+ * rates or reuse distances. --per-pc writes the per-branch counts of all the branches as
+ * CSV (with a header line); with several traces, each file name gets the name of its
+ * trace appended.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "bt9_reader.h"
+#include "branch_decode.h"
+
+#define REUSE_BUCKETS 34  // 0, [1, 2), [2, 4), ..., [2^32, inf)
+#define REUSE_COLD REUSE_BUCKETS
+
+static const char *OpTypeName(int op_type) {
+    static const char *names[] = {"RET_UNCOND", "JMP_DIRECT_UNCOND", "JMP_INDIRECT_UNCOND", "CALL_DIRECT_UNCOND",
+                                  "CALL_INDIRECT_UNCOND", "RET_COND", "JMP_DIRECT_COND", "JMP_INDIRECT_COND",
+                                  "CALL_DIRECT_COND", "CALL_INDIRECT_COND"};
+    if (op_type < OPTYPE_RET_UNCOND || op_type >= OPTYPE_ERROR) {
+        return "ERROR";
+    }
+    return names[op_type - OPTYPE_RET_UNCOND];
+}
+
+/*!
+ * \class ReuseDistance
+ * \brief Stack (reuse) distances of a stream of keys, in O(log keys) per access
+ *
+ * Every key has a mark at the time of its last access in a Fenwick tree over time, so the
+ * number of distinct keys accessed since the last access of a key is the number of marks
+ * after it. Time is renumbered (keeping the order of the marks) whenever it runs out of
+ * the tree, which holds twice as many slots as there are keys.
+ */
+class ReuseDistance {
+    public:
+        static const uint64_t COLD = UINT64_MAX;
+
+        explicit ReuseDistance(size_t keys)
+            : last_(keys, NEVER), tree_(std::max<size_t>(2 * keys, 1024) + 1, 0) {}
+
+        /// The reuse distance of this access of key, COLD on its first access
+        uint64_t access(uint32_t key) {
+            if (now_ + 1 == tree_.size()) {
+                compact();
+            }
+            uint64_t distance = COLD;
+            size_t last = last_[key];
+            if (last != NEVER) {
+                distance = marks_ - prefix(last);
+                add(last, -1);
+            } else {
+                marks_++;
+            }
+            add(now_, 1);
+            last_[key] = now_++;
+            return distance;
+        }
+
+    private:
+        static const size_t NEVER = SIZE_MAX;
+
+        void add(size_t pos, int32_t delta) {
+            for (pos++; pos < tree_.size(); pos += pos & (0 - pos)) {
+                tree_[pos] += delta;
+            }
+        }
+
+        /// Number of marks at times <= pos
+        uint64_t prefix(size_t pos) const {
+            uint64_t sum = 0;
+            for (pos++; pos > 0; pos -= pos & (0 - pos)) {
+                sum += tree_[pos];
+            }
+            return sum;
+        }
+
+        /// Give the keys the times 0 .. marks - 1, in the order of their last accesses
+        void compact() {
+            std::vector<std::pair<size_t, uint32_t> > order;
+            for (size_t key = 0; key < last_.size(); key++) {
+                if (last_[key] != NEVER) {
+                    order.push_back(std::make_pair(last_[key], (uint32_t) key));
+                }
+            }
+            std::sort(order.begin(), order.end());
+            std::fill(tree_.begin(), tree_.end(), 0);
+            for (size_t t = 0; t < order.size(); t++) {
+                last_[order[t].second] = t;
+                add(t, 1);
+            }
+            now_ = order.size();
+        }
+
+        std::vector<size_t> last_;     // time of the last access of each key
+        std::vector<int32_t> tree_;    // Fenwick tree of the marks, 1-based
+        size_t now_ = 0;
+        uint64_t marks_ = 0;           // keys accessed so far
+};
+
+const uint64_t ReuseDistance::COLD;
+const size_t ReuseDistance::NEVER;
+
+// Counts of one static branch (node)
+struct BranchStats {
+    uint64_t PC = 0;
+    int op_type = OPTYPE_ERROR;
+    uint64_t executions = 0;
+    uint64_t taken = 0;
+    uint64_t transitions = 0;  // direction differs from the previous execution
+    uint64_t targets = 0;      // executed edges leaving the node
+    int last_dir = -1;
+};
+
+// Everything reported for one trace
+struct TraceStats {
+    uint64_t instructions = 0;
+    uint64_t header_branches = 0;
+    uint64_t edges = 0;
+    uint64_t executed_edges = 0;
+    std::vector<BranchStats> branches;       // indexed by node
+    uint64_t reuse[REUSE_BUCKETS + 1] = {};  // + cold
+    bool streamed = false;
+};
+
+static uint64_t HeaderCount(bt9::BT9Reader &reader, const char *field) {
+    std::string key = field;
+    std::string value;
+    if (!reader.header.getFieldValueStr(key, value)) {
+        return 0;
+    }
+    return std::stoull(value, nullptr, 0);
+}
+
+static int ReuseBucket(uint64_t distance) {
+    if (distance == ReuseDistance::COLD) {
+        return REUSE_COLD;
+    }
+    int bucket = 0;
+    while (distance > 0 && bucket < REUSE_BUCKETS - 1) {
+        distance >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// The node table: addresses and OpTypes of the branches, and their observed counts
+static void ReadNodes(bt9::BT9Reader &reader, TraceStats &stats) {
+    uint32_t max_index = 0;
+    for (auto it = reader.node_table.begin(); it != reader.node_table.end(); ++it) {
+        max_index = std::max(max_index, it->brNodeIndex());
+    }
+    stats.branches.resize((size_t) max_index + 1);
+    for (auto it = reader.node_table.begin(); it != reader.node_table.end(); ++it) {
+        BranchStats &branch = stats.branches[it->brNodeIndex()];
+        branch.PC = it->brVirtualAddr();
+        branch.op_type = decodeOpType(it->brClass());
+        branch.executions = (uint64_t) it->brObservedTakenCnt() + it->brObservedNotTakenCnt();
+        branch.taken = it->brObservedTakenCnt();
+    }
+}
+
+// The edge table: footprint of the paths, and the targets of each branch
+static void ReadEdges(bt9::BT9Reader &reader, TraceStats &stats) {
+    for (auto it = reader.edge_table.begin(); it != reader.edge_table.end(); ++it) {
+        stats.edges++;
+        if (it->observedTraverseCnt() > 0 && it->srcNodeIndex() < stats.branches.size()) {
+            stats.executed_edges++;
+            stats.branches[it->srcNodeIndex()].targets++;
+        }
+    }
+}
+
+// Replace the observed counts of the node table by the ones of the edge sequence
+static void StreamTrace(bt9::BT9Reader &reader, TraceStats &stats) {
+    for (BranchStats &branch : stats.branches) {
+        branch.executions = branch.taken = 0;
+    }
+    ReuseDistance reuse(stats.branches.size());
+    for (auto it = reader.begin(); it != reader.end(); ++it) {
+        try {
+            uint32_t index = it->getSrcNode()->brNodeIndex();
+            BranchStats &branch = stats.branches[index];
+            if (branch.op_type == OPTYPE_ERROR) {
+                continue; // the dummy first branch
+            }
+            int dir = it->getEdge()->isTakenPath();
+            branch.executions++;
+            branch.taken += dir;
+            branch.transitions += branch.last_dir >= 0 && dir != branch.last_dir;
+            branch.last_dir = dir;
+            stats.reuse[ReuseBucket(reuse.access(index))]++;
+        }
+        catch (const std::out_of_range &ex) {
+            std::cout << ex.what() << '\n';
+            break;
+        }
+    }
+    stats.streamed = true;
+}
+
+static double Ratio(uint64_t a, uint64_t b) {
+    return b ? (double) a / (double) b : 0.0;
+}
+
+static void PrintStats(const std::string &trace_path, const TraceStats &stats, size_t top) {
+    uint64_t static_br[OPTYPE_MAX] = {}, executed_br[OPTYPE_MAX] = {}, dynamic[OPTYPE_MAX] = {},
+             taken[OPTYPE_MAX] = {}, transitions[OPTYPE_MAX] = {};
+    uint64_t total = 0, total_taken = 0, total_transitions = 0, footprint = 0, static_total = 0;
+    std::vector<const BranchStats *> executed;
+    for (const BranchStats &branch : stats.branches) {
+        if (branch.op_type == OPTYPE_ERROR) {
+            continue;
+        }
+        static_total++;
+        static_br[branch.op_type]++;
+        if (branch.executions > 0) {
+            executed_br[branch.op_type]++;
+            footprint++;
+            executed.push_back(&branch);
+        }
+        dynamic[branch.op_type] += branch.executions;
+        taken[branch.op_type] += branch.taken;
+        transitions[branch.op_type] += branch.transitions;
+        total += branch.executions;
+        total_taken += branch.taken;
+        total_transitions += branch.transitions;
+    }
+
+    printf("TRACE %s (%s)\n", trace_path.c_str(), stats.streamed ? "streamed" : "node and edge tables only");
+    printf("  NUM_INSTRUCTIONS            : %12llu\n", (unsigned long long) stats.instructions);
+    // there is a dummy branch at the beginning of the trace
+    printf("  NUM_BR (header)             : %12llu\n",
+           (unsigned long long) (stats.header_branches ? stats.header_branches - 1 : 0));
+    printf("  NUM_BR                      : %12llu\n", (unsigned long long) total);
+    printf("  STATIC_BR                   : %12llu\n", (unsigned long long) static_total);
+    printf("  EXECUTED_STATIC_BR          : %12llu\n", (unsigned long long) footprint);
+    printf("  EDGES (executed)            : %12llu (%llu)\n", (unsigned long long) stats.edges,
+           (unsigned long long) stats.executed_edges);
+    printf("  TAKEN_RATE                  : %12.4f\n", Ratio(total_taken, total));
+    if (stats.streamed) {
+        printf("  TRANSITION_RATE             : %12.4f\n", Ratio(total_transitions, total));
+    }
+
+    printf("  %-22s %10s %10s %12s %7s %7s", "opType", "static", "executed", "dynamic", "share", "taken");
+    printf(stats.streamed ? " %7s\n" : "\n", "trans.");
+    for (int op = OPTYPE_RET_UNCOND; op < OPTYPE_ERROR; op++) {
+        if (static_br[op] == 0) {
+            continue;
+        }
+        printf("  %-22s %10llu %10llu %12llu %7.4f %7.4f", OpTypeName(op), (unsigned long long) static_br[op],
+               (unsigned long long) executed_br[op], (unsigned long long) dynamic[op], Ratio(dynamic[op], total),
+               Ratio(taken[op], dynamic[op]));
+        if (stats.streamed) {
+            printf(" %7.4f", Ratio(transitions[op], dynamic[op]));
+        }
+        printf("\n");
+    }
+
+    std::sort(executed.begin(), executed.end(), [](const BranchStats *a, const BranchStats *b) {
+        return a->executions != b->executions ? a->executions > b->executions : a->PC < b->PC;
+    });
+    if (executed.size() > top) {
+        executed.resize(top);
+    }
+    printf("  %-18s %-22s %12s %7s %7s %7s", "PC", "opType", "executions", "share", "cumul.", "taken");
+    printf(" %7s\n", stats.streamed ? "trans." : "edges");
+    uint64_t cumulative = 0;
+    for (const BranchStats *branch : executed) {
+        cumulative += branch->executions;
+        printf("  0x%016llx %-22s %12llu %7.4f %7.4f %7.4f", (unsigned long long) branch->PC,
+               OpTypeName(branch->op_type), (unsigned long long) branch->executions,
+               Ratio(branch->executions, total), Ratio(cumulative, total), Ratio(branch->taken, branch->executions));
+        if (stats.streamed) {
+            printf(" %7.4f\n", Ratio(branch->transitions, branch->executions));
+        } else {
+            printf(" %7llu\n", (unsigned long long) branch->targets);
+        }
+    }
+
+    if (stats.streamed) {
+        printf("  %-22s %12s %7s %7s\n", "reuse distance", "count", "share", "cumul.");
+        uint64_t accesses = 0;
+        for (uint64_t count : stats.reuse) {
+            accesses += count;
+        }
+        cumulative = 0;
+        for (int bucket = 0; bucket <= REUSE_BUCKETS; bucket++) {
+            if (stats.reuse[bucket] == 0) {
+                continue;
+            }
+            char range[32];
+            if (bucket == REUSE_COLD) {
+                snprintf(range, sizeof(range), "cold");
+            } else if (bucket <= 1) {
+                snprintf(range, sizeof(range), "%d", bucket);
+            } else if (bucket == REUSE_BUCKETS - 1) {
+                snprintf(range, sizeof(range), ">= %llu", 1ULL << (bucket - 1));
+            } else {
+                snprintf(range, sizeof(range), "%llu - %llu", 1ULL << (bucket - 1), (1ULL << bucket) - 1);
+            }
+            cumulative += stats.reuse[bucket];
+            printf("  %-22s %12llu %7.4f %7.4f\n", range, (unsigned long long) stats.reuse[bucket],
+                   Ratio(stats.reuse[bucket], accesses), Ratio(cumulative, accesses));
+        }
+    }
+    fflush(stdout);
+}
+
+static bool WritePerPC(const std::string &path, const TraceStats &stats) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open %s for writing\n", path.c_str());
+        return false;
+    }
+    fprintf(out, "PC,opType,executions,taken,transitions,targets\n");
+    for (const BranchStats &branch : stats.branches) {
+        if (branch.op_type == OPTYPE_ERROR) {
+            continue;
+        }
+        fprintf(out, "%llu,%d,%llu,%llu,%llu,%llu\n", (unsigned long long) branch.PC, branch.op_type,
+                (unsigned long long) branch.executions, (unsigned long long) branch.taken,
+                (unsigned long long) branch.transitions, (unsigned long long) branch.targets);
+    }
+    return fclose(out) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> trace_paths;
+    std::string per_pc_path;
+    bool static_only = false;
+    size_t top = 20;
+    bool bad_args = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--static") == 0) {
+            static_only = true;
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            bad_args |= *end != '\0' || n < 0;
+            top = (size_t) n;
+        } else if (strcmp(argv[i], "--per-pc") == 0 && i + 1 < argc) {
+            per_pc_path = argv[++i];
+        } else if (argv[i][0] != '-') {
+            trace_paths.push_back(argv[i]);
+        } else {
+            bad_args = true;
+        }
+    }
+
+    if (trace_paths.empty() || bad_args) {
+        printf("usage: %s [--static] [--top <N>] [--per-pc <file.csv>] <trace> [<trace> ...]\n", argv[0]);
+        exit(-1);
+    }
+
+    int status = 0;
+    for (const std::string &trace_path : trace_paths) {
+        bt9::BT9Reader reader(trace_path);
+        TraceStats stats;
+        stats.instructions = HeaderCount(reader, "total_instruction_count:");
+        stats.header_branches = HeaderCount(reader, "branch_instruction_count:");
+        ReadNodes(reader, stats);
+        ReadEdges(reader, stats);
+        if (!static_only) {
+            StreamTrace(reader, stats);
+        }
+        PrintStats(trace_path, stats, top);
+        if (!per_pc_path.empty()) {
+            std::string path = per_pc_path;
+            if (trace_paths.size() > 1) {
+                size_t slash = trace_path.rfind('/');
+                path += "." + trace_path.substr(slash == std::string::npos ? 0 : slash + 1);
+            }
+            if (!WritePerPC(path, stats)) {
+                status = 1;
+            }
+        }
+    }
+    return status;
+}